@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "aead.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define KEYLEN 32
+#define NONCELEN 12
+#define BLOCKLEN 64
+/* ChaCha20 blocks made at once, one per vector lane */
+#define LANES 4
+
+typedef uint32_t vec __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+static struct {
+	int enabled;
+	/* ChaCha20 key words */
+	uint32_t key[KEYLEN / 4];
+	uint64_t nonce;
+} aead;
+
+static uint32_t load32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void store32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void store64(uint8_t *p, uint64_t v)
+{
+	store32(p, v);
+	store32(p + 4, v >> 32);
+}
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7);
+
+/* Make LANES keystream blocks starting at block counter ctr */
+static void chacha20_blocks(const uint32_t state[16], uint32_t ctr,
+	uint8_t out[LANES * BLOCKLEN])
+{
+	vec x[16];
+	vec in[16];
+	int i;
+	int j;
+
+	for (i = 0; i < 16; i++) {
+		vec v = { state[i], state[i], state[i], state[i] };
+		in[i] = v;
+	}
+	for (i = 0; i < LANES; i++)
+		in[12][i] = ctr + i;
+	memcpy(x, in, sizeof(x));
+	for (i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (i = 0; i < 16; i++) {
+		x[i] += in[i];
+		for (j = 0; j < LANES; j++)
+			store32(&out[j * BLOCKLEN + i * 4], x[i][j]);
+	}
+}
+
+/* Xor len bytes with keystream from block 1, and give the
+ * Poly1305 key from block 0 */
+static void chacha20_xor(const uint32_t key[8], const uint8_t nonce[NONCELEN],
+	uint8_t *out, const uint8_t *in, size_t len, uint8_t polykey[32])
+{
+	uint8_t ks[LANES * BLOCKLEN];
+	uint32_t state[16];
+	uint32_t ctr = 0;
+	size_t avail;
+	size_t pos;
+	size_t i;
+
+	state[0] = 0x61707865;
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	memcpy(&state[4], key, KEYLEN);
+	state[12] = 0;
+	state[13] = load32(&nonce[0]);
+	state[14] = load32(&nonce[4]);
+	state[15] = load32(&nonce[8]);
+
+	chacha20_blocks(state, ctr, ks);
+	memcpy(polykey, ks, 32);
+	pos = BLOCKLEN;
+	avail = sizeof(ks) - BLOCKLEN;
+	while (len) {
+		size_t n = len < avail ? len : avail;
+		for (i = 0; i < n; i++)
+			out[i] = in[i] ^ ks[pos + i];
+		out += n;
+		in += n;
+		len -= n;
+		if (len) {
+			ctr += LANES;
+			chacha20_blocks(state, ctr, ks);
+			pos = 0;
+			avail = sizeof(ks);
+		}
+	}
+}
+
+/* Poly1305 with 26 bit limbs */
+struct poly1305 {
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t pad[4];
+};
+
+#define MASK26 0x3ffffff
+
+static void poly1305_init(struct poly1305 *p, const uint8_t key[32])
+{
+	int i;
+
+	p->r[0] = load32(&key[0]) & 0x3ffffff;
+	p->r[1] = (load32(&key[3]) >> 2) & 0x3ffff03;
+	p->r[2] = (load32(&key[6]) >> 4) & 0x3ffc0ff;
+	p->r[3] = (load32(&key[9]) >> 6) & 0x3f03fff;
+	p->r[4] = (load32(&key[12]) >> 8) & 0x00fffff;
+	memset(p->h, 0, sizeof(p->h));
+	for (i = 0; i < 4; i++)
+		p->pad[i] = load32(&key[16 + i * 4]);
+}
+
+/* Only whole 16 byte blocks, the AEAD construction pads with zeros */
+static void poly1305_blocks(struct poly1305 *p, const uint8_t *m, size_t len)
+{
+	uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+	uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+	uint64_t d0, d1, d2, d3, d4;
+	uint32_t c;
+
+	while (len >= 16) {
+		h0 += load32(&m[0]) & MASK26;
+		h1 += (load32(&m[3]) >> 2) & MASK26;
+		h2 += (load32(&m[6]) >> 4) & MASK26;
+		h3 += (load32(&m[9]) >> 6) & MASK26;
+		h4 += (load32(&m[12]) >> 8) | (1 << 24);
+
+		d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3 +
+			(uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+		d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4 +
+			(uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+		d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0 +
+			(uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+		d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1 +
+			(uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+		d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2 +
+			(uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+
+		c = d0 >> 26; h0 = d0 & MASK26;
+		d1 += c; c = d1 >> 26; h1 = d1 & MASK26;
+		d2 += c; c = d2 >> 26; h2 = d2 & MASK26;
+		d3 += c; c = d3 >> 26; h3 = d3 & MASK26;
+		d4 += c; c = d4 >> 26; h4 = d4 & MASK26;
+		h0 += c * 5; c = h0 >> 26; h0 &= MASK26;
+		h1 += c;
+
+		m += 16;
+		len -= 16;
+	}
+	p->h[0] = h0;
+	p->h[1] = h1;
+	p->h[2] = h2;
+	p->h[3] = h3;
+	p->h[4] = h4;
+}
+
+static void poly1305_finish(struct poly1305 *p, uint8_t tag[16])
+{
+	uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+	uint32_t g0, g1, g2, g3, g4;
+	uint32_t c;
+	uint32_t mask;
+	uint64_t f;
+
+	c = h1 >> 26; h1 &= MASK26;
+	h2 += c; c = h2 >> 26; h2 &= MASK26;
+	h3 += c; c = h3 >> 26; h3 &= MASK26;
+	h4 += c; c = h4 >> 26; h4 &= MASK26;
+	h0 += c * 5; c = h0 >> 26; h0 &= MASK26;
+	h1 += c;
+
+	/* h - p, used if h >= p */
+	g0 = h0 + 5; c = g0 >> 26; g0 &= MASK26;
+	g1 = h1 + c; c = g1 >> 26; g1 &= MASK26;
+	g2 = h2 + c; c = g2 >> 26; g2 &= MASK26;
+	g3 = h3 + c; c = g3 >> 26; g3 &= MASK26;
+	g4 = h4 + c - (1 << 26);
+
+	mask = (g4 >> 31) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+	h3 = (h3 & ~mask) | (g3 & mask);
+	h4 = (h4 & ~mask) | (g4 & mask);
+
+	h0 = h0 | (h1 << 26);
+	h1 = (h1 >> 6) | (h2 << 20);
+	h2 = (h2 >> 12) | (h3 << 14);
+	h3 = (h3 >> 18) | (h4 << 8);
+
+	f = (uint64_t) h0 + p->pad[0]; store32(&tag[0], f);
+	f = (uint64_t) h1 + p->pad[1] + (f >> 32); store32(&tag[4], f);
+	f = (uint64_t) h2 + p->pad[2] + (f >> 32); store32(&tag[8], f);
+	f = (uint64_t) h3 + p->pad[3] + (f >> 32); store32(&tag[12], f);
+}
+
+static void poly1305_padded(struct poly1305 *p, const uint8_t *m, size_t len)
+{
+	uint8_t last[16];
+	size_t whole = len & ~15;
+
+	poly1305_blocks(p, m, whole);
+	if (len > whole) {
+		memset(last, 0, sizeof(last));
+		memcpy(last, &m[whole], len - whole);
+		poly1305_blocks(p, last, sizeof(last));
+	}
+}
+
+static void aead_mac(const uint8_t polykey[32], const uint8_t *aad, size_t aadlen,
+	const uint8_t *ct, size_t len, uint8_t tag[AEAD_TAGLEN])
+{
+	struct poly1305 p;
+	uint8_t lens[16];
+
+	poly1305_init(&p, polykey);
+	poly1305_padded(&p, aad, aadlen);
+	poly1305_padded(&p, ct, len);
+	store64(&lens[0], aadlen);
+	store64(&lens[8], len);
+	poly1305_blocks(&p, lens, sizeof(lens));
+	poly1305_finish(&p, tag);
+}
+
+static void make_nonce(uint8_t nonce[NONCELEN], uint64_t n)
+{
+	store32(&nonce[0], 0);
+	store64(&nonce[4], n);
+}
+
+int aead_enable()
+{
+	uint8_t key[KEYLEN];
+	FILE *f;
+	int i;
+
+	f = fopen("/dev/urandom", "r");
+	if (!f) {
+		perror("Failed to open /dev/urandom");
+		return -1;
+	}
+	if (fread(key, sizeof(key), 1, f) != 1) {
+		fprintf(stderr, "Failed to read encryption key\n");
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	for (i = 0; i < KEYLEN / 4; i++)
+		aead.key[i] = load32(&key[i * 4]);
+	memset(key, 0, sizeof(key));
+	aead.enabled = 1;
+	return 0;
+}
+
+void aead_disable()
+{
+	memset(&aead, 0, sizeof(aead));
+}
+
+int aead_enabled()
+{
+	return aead.enabled;
+}
+
+uint64_t aead_seal(uint8_t *data, size_t len, uint8_t tag[AEAD_TAGLEN])
+{
+	uint8_t nonce[NONCELEN];
+	uint8_t polykey[32];
+	uint64_t n;
+
+	/* Never reuse a nonce with the same key */
+	n = __atomic_fetch_add(&aead.nonce, 1, __ATOMIC_RELAXED);
+	make_nonce(nonce, n);
+	chacha20_xor(aead.key, nonce, data, data, len, polykey);
+	aead_mac(polykey, NULL, 0, data, len, tag);
+	return n;
+}
+
+int aead_open(uint64_t n, const uint8_t *in, uint8_t *out, size_t len,
+	const uint8_t tag[AEAD_TAGLEN])
+{
+	uint8_t nonce[NONCELEN];
+	uint8_t polykey[32];
+	uint8_t calc[AEAD_TAGLEN];
+	uint8_t diff = 0;
+	int i;
+
+	make_nonce(nonce, n);
+	/* Tag is over the ciphertext, check it before in is overwritten */
+	chacha20_xor(aead.key, nonce, out, in, 0, polykey);
+	aead_mac(polykey, NULL, 0, in, len, calc);
+	for (i = 0; i < AEAD_TAGLEN; i++)
+		diff |= calc[i] ^ tag[i];
+	if (diff)
+		return -1;
+	chacha20_xor(aead.key, nonce, out, in, len, polykey);
+	return 0;
+}
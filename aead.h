@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef PINGFS_AEAD_H_
+#define PINGFS_AEAD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AEAD_TAGLEN 16
+
+/* Encrypt chunk data with ChaCha20-Poly1305 (RFC 8439), using a
+ * random key made now. Data only lives while mounted, so the key
+ * is never stored. Returns 0 on success */
+int aead_enable();
+/* Forget the key */
+void aead_disable();
+int aead_enabled();
+
+/* Encrypt data in place and make its tag. Returns the nonce
+ * used, needed to open it again */
+uint64_t aead_seal(uint8_t *data, size_t len, uint8_t tag[AEAD_TAGLEN]);
+
+/* Check tag and decrypt in to out, which can be the same as in.
+ * Returns 0 if data is authentic, -1 otherwise */
+int aead_open(uint64_t nonce, const uint8_t *in, uint8_t *out, size_t len,
+	const uint8_t tag[AEAD_TAGLEN]);
+
+#endif /* PINGFS_AEAD_H_ */
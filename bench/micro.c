@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Microbenchmarks of the packet and chunk hot paths, linked
+ * with the pingfs objects. Prints ns and cycles per operation */
+
+#include "icmp.h"
+#include "host.h"
+#include "net.h"
+#include "chunk.h"
+#include "crc32c.h"
+#include "aead.h"
+#include "fs.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+/* Run each benchmark for at least this long */
+#define MIN_NS 200000000ULL
+
+struct clock {
+	uint64_t ns;
+	uint64_t cycles;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void clock_read(struct clock *c)
+{
+	c->ns = now_ns();
+#ifdef HAVE_TSC
+	c->cycles = __rdtsc();
+#else
+	c->cycles = 0;
+#endif
+}
+
+static void report(const char *name, const char *param, uint64_t ops,
+	struct clock *start, struct clock *end)
+{
+	printf("%-22s %-14s %12.1f ns/op", name, param,
+		(double) (end->ns - start->ns) / ops);
+#ifdef HAVE_TSC
+	printf(" %12.1f cycles/op", (double) (end->cycles - start->cycles) / ops);
+#endif
+	printf(" %12llu ops\n", (unsigned long long) ops);
+}
+
+/* Repeat body in batches until MIN_NS has passed */
+#define BENCH(name, param, body) do { \
+		struct clock start, end; \
+		uint64_t ops = 0; \
+		clock_read(&start); \
+		do { \
+			int batch_; \
+			for (batch_ = 0; batch_ < 1000; batch_++) { \
+				body; \
+			} \
+			ops += 1000; \
+			clock_read(&end); \
+		} while (end.ns - start.ns < MIN_NS); \
+		report(name, param, ops, &start, &end); \
+	} while (0)
+
+static const int sizes[] = { 64, 256, 1024 };
+#define SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static volatile uint32_t sink;
+
+static void bench_icmp()
+{
+	uint8_t hdr[ICMP_MAX_HDRLEN];
+	uint8_t payload[CHUNK_SIZE];
+	uint8_t packet[20 + ICMP_HDRLEN + CHUNK_SIZE];
+	struct icmp_packet pkt;
+	char param[32];
+	unsigned i;
+
+	for (i = 0; i < sizeof(payload); i++)
+		payload[i] = i * 7;
+
+	for (i = 0; i < SIZES; i++) {
+		int len = sizes[i];
+		int hdrlen;
+
+		memset(&pkt, 0, sizeof(pkt));
+		pkt.peer.ss_family = AF_INET;
+		pkt.transport = ICMP_RAW;
+		pkt.type = ICMP_REQUEST;
+		pkt.id = 0x1234;
+		pkt.payload = payload;
+		pkt.payload_len = len;
+		snprintf(param, sizeof(param), "%d bytes", len);
+		BENCH("checksum", param, {
+			sink += icmp_checksum(payload, len);
+		});
+		/* Checksum over header and payload */
+		BENCH("icmp_encode", param, {
+			pkt.seqno++;
+			sink += icmp_encode(&pkt, hdr);
+		});
+
+		/* Reply as a raw socket gives it, with an IPv4 header */
+		pkt.type = ICMP_REPLY;
+		hdrlen = icmp_encode(&pkt, hdr);
+		memset(packet, 0, 20);
+		packet[0] = 0x45;
+		packet[2] = (20 + hdrlen + len) >> 8;
+		packet[3] = (20 + hdrlen + len) & 0xff;
+		memcpy(&packet[20], hdr, hdrlen);
+		memcpy(&packet[20 + hdrlen], payload, len);
+		BENCH("icmp_parse", param, {
+			struct icmp_packet in;
+			memset(&in, 0, sizeof(in));
+			in.peer.ss_family = AF_INET;
+			in.transport = ICMP_RAW;
+			sink += icmp_parse(&in, packet, 20 + hdrlen + len);
+		});
+		if (icmp_parse(&pkt, packet, 20 + hdrlen + len))
+			printf("icmp_parse failed!\n");
+
+		BENCH("crc32c", param, {
+			sink += crc32c(0, payload, len);
+		});
+	}
+}
+
+/* Size of one file, summed over its chunks. No replies are read,
+ * so the chunks are sent once and stay put */
+static void bench_getattr_size(struct host *h)
+{
+	static const int counts[] = { 1, 16, 256, 4096 };
+	char buf[CHUNK_SIZE];
+	char param[32];
+	unsigned i;
+	int n = 0;
+
+	memset(buf, 4, sizeof(buf));
+	__atomic_store_n(&h->cwnd_chunks, 1 << 20, __ATOMIC_RELAXED);
+	host_use(h);
+	fs_mknod("/sized", S_IFREG | 0644);
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		for (; n < counts[i]; n++) {
+			if (fs_write("/sized", buf, CHUNK_SIZE, (off_t) n * CHUNK_SIZE) != CHUNK_SIZE) {
+				printf("getattr size: write failed\n");
+				return;
+			}
+		}
+		snprintf(param, sizeof(param), "%d chunks", n);
+		BENCH("getattr size", param, {
+			struct stat st;
+			sink += fs_getattr("/sized", &st);
+		});
+	}
+}
+
+/* Last, as chunks are encrypted from now on */
+static void bench_aead()
+{
+	uint8_t payload[CHUNK_SIZE];
+	char param[32];
+	unsigned i;
+
+	if (aead_enable())
+		return;
+	memset(payload, 3, sizeof(payload));
+	for (i = 0; i < SIZES; i++) {
+		int len = sizes[i];
+
+		snprintf(param, sizeof(param), "%d bytes", len);
+		BENCH("aead_seal", param, {
+			uint8_t tag[AEAD_TAGLEN];
+			sink += aead_seal(payload, len, tag);
+		});
+	}
+}
+
+static struct host *make_host()
+{
+	struct host *h = calloc(1, sizeof(*h));
+	struct sockaddr_in *sin = (struct sockaddr_in *) &h->sockaddr;
+
+	sin->sin_family = AF_INET;
+	inet_pton(AF_INET, "127.0.0.1", &sin->sin_addr);
+	h->sockaddr_len = sizeof(*sin);
+	return h;
+}
+
+static void bench_reply(struct host *h)
+{
+	/* Up to all ids for file chunks */
+	static const int counts[] = { 16, 256, 4096, 61440 };
+	struct sockaddr_storage addr;
+	struct chunk **chunks;
+	uint8_t payload[CHUNK_SIZE];
+	char param[32];
+	unsigned i;
+	int n;
+
+	memset(&addr, 0, sizeof(addr));
+	memset(payload, 1, sizeof(payload));
+	chunks = calloc(counts[3], sizeof(struct chunk *));
+	n = 0;
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		struct chunk *oldest;
+
+		for (; n < counts[i]; n++) {
+			chunks[n] = chunk_create();
+			chunks[n]->len = CHUNK_SIZE;
+			chunks[n]->host = h;
+			chunks[n]->crc = crc32c(0, payload, CHUNK_SIZE);
+			chunk_add(chunks[n]);
+		}
+		/* Chunks are found by id, this should not grow with
+		 * the count. A wrong seqno stops after the lookup */
+		oldest = chunks[0];
+		snprintf(param, sizeof(param), "%d chunks", n);
+		BENCH("chunk_reply lookup", param, {
+			uint8_t *data = payload;
+			chunk_reply(NULL, &addr, sizeof(addr), oldest->id,
+				oldest->seqno + 1, 0, &data, CHUNK_SIZE);
+		});
+	}
+	/* Newest first, they are at the head of the list */
+	while (n--) {
+		chunk_remove(chunks[n]);
+		chunk_free(chunks[n]);
+	}
+	free(chunks);
+}
+
+static struct {
+	struct chunk *c;
+	uint8_t payload[CHUNK_SIZE];
+	int done;
+} handoff;
+
+/* Plays the network thread, sending replies for the chunk */
+static void *reply_thread(void *arg)
+{
+	struct sockaddr_storage addr;
+
+	memset(&addr, 0, sizeof(addr));
+	while (!__atomic_load_n(&handoff.done, __ATOMIC_RELAXED)) {
+		uint8_t *data = handoff.payload;
+		/* Only reply when the reader waits, a busy loop on
+		 * chunk_mutex would starve it */
+		if (!__atomic_load_n(&handoff.c->io, __ATOMIC_ACQUIRE))
+			continue;
+		chunk_reply(NULL, &addr, sizeof(addr), handoff.c->id,
+			handoff.c->seqno, 0, &data, handoff.c->len);
+	}
+	return NULL;
+}
+
+static void bench_handoff(struct host *h)
+{
+	pthread_t thread;
+
+	memset(handoff.payload, 2, sizeof(handoff.payload));
+	handoff.c = chunk_create();
+	handoff.c->len = CHUNK_SIZE;
+	handoff.c->host = h;
+	handoff.c->crc = crc32c(0, handoff.payload, CHUNK_SIZE);
+	chunk_add(handoff.c);
+	pthread_create(&thread, NULL, reply_thread, NULL);
+
+	/* Each reply is also resent, if sockets could be opened */
+	BENCH("wait/release", "1 chunk", {
+		uint8_t *data;
+		if (chunk_wait_for(handoff.c, &data) > 0)
+			chunk_release(handoff.c);
+	});
+	/* Written back unchanged, so replies still match. Adds the
+	 * seal and a fresh send. Encrypted sealing is aead_seal */
+	BENCH("wait/done", "1 chunk", {
+		uint8_t *data;
+		if (chunk_wait_for(handoff.c, &data) > 0)
+			chunk_done(handoff.c, handoff.c->len);
+	});
+
+	__atomic_store_n(&handoff.done, 1, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	chunk_remove(handoff.c);
+	chunk_free(handoff.c);
+}
+
+/* Lookup of a file among many empty ones */
+static void bench_getattr()
+{
+	static const int counts[] = { 10, 100, 1000, 10000 };
+	char name[64];
+	char param[32];
+	unsigned i;
+	int n = 0;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		for (; n < counts[i]; n++) {
+			snprintf(name, sizeof(name), "/file%d", n);
+			fs_mknod(name, S_IFREG | 0644);
+		}
+		/* Files are added first in list, the first one made is found last */
+		snprintf(param, sizeof(param), "%d files", n);
+		BENCH("getattr", param, {
+			struct stat st;
+			sink += fs_getattr("/file0", &st);
+		});
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct host *h;
+
+	/* Show results as they come */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	/* Replies are resent like when mounted, if allowed to */
+	if (net_open_sockets())
+		printf("No ICMP sockets, replies are not resent\n");
+	host_set_timeout(1);
+	chunk_set_timeout(1);
+	h = make_host();
+
+	bench_icmp();
+	bench_reply(h);
+	bench_handoff(h);
+	bench_getattr();
+	bench_getattr_size(h);
+	bench_aead();
+	return EXIT_SUCCESS;
+}
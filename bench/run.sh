@@ -0,0 +1,159 @@
+#!/bin/sh
+#
+# Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+#
+# Permission to use, copy, modify, and/or distribute this software for any purpose
+# with or without fee is hereby granted, provided that the above copyright notice
+# and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+# REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+# FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+# INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+# LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+# OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+# PERFORMANCE OF THIS SOFTWARE.
+#
+# Benchmark pingfs against local echo hosts. Each host is a network
+# namespace behind a veth pair, with netem adding delay, loss and a
+# rate limit. Runs a set of fio workloads on the mounted filesystem and
+# writes one JSON document with throughput and latency percentiles.
+#
+# Needs root, iproute2 with netem, fio, jq and FUSE.
+#
+# Settings, from the environment:
+#  HOSTS    number of echo hosts, at most 256 (default 8)
+#  DELAY    netem delay each way (default 10ms)
+#  JITTER   netem delay jitter (default 1ms)
+#  LOSS     netem loss each way (default 0%)
+#  RATE     netem rate limit per host (default 100mbit)
+#  SIZE     file size for read/write workloads (default 256k)
+#  FILES    files for create/stat workloads (default 200)
+#  RUNTIME  seconds per timed workload (default 10)
+#  OPTS     extra pingfs options
+#  OUT      result file (default bench-result.json)
+
+set -e
+
+HOSTS=${HOSTS:-8}
+DELAY=${DELAY:-10ms}
+JITTER=${JITTER:-1ms}
+LOSS=${LOSS:-0%}
+RATE=${RATE:-100mbit}
+SIZE=${SIZE:-256k}
+FILES=${FILES:-200}
+RUNTIME=${RUNTIME:-10}
+OPTS=${OPTS:-}
+OUT=${OUT:-bench-result.json}
+
+NS=pingfs-bench
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d /tmp/pingfs-bench.XXXXXX)
+MNT=$WORK/mnt
+PID=
+
+for tool in ip tc fio jq fusermount; do
+	if ! command -v $tool >/dev/null; then
+		echo "$tool is needed to run the benchmark" >&2
+		exit 1
+	fi
+done
+if [ "$(id -u)" != 0 ]; then
+	echo "Benchmark must run as root" >&2
+	exit 1
+fi
+
+cleanup() {
+	set +e
+	if [ -n "$PID" ]; then
+		fusermount -u "$MNT" 2>/dev/null
+		wait "$PID"
+	fi
+	i=0
+	while [ $i -lt "$HOSTS" ]; do
+		ip link del pfb$i 2>/dev/null
+		ip netns del $NS-$i 2>/dev/null
+		i=$((i + 1))
+	done
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+# Host i is 10.201.i.2, reached from 10.201.i.1. Netem on both ends
+# gives the delay and loss on each way of the round trip
+i=0
+while [ $i -lt "$HOSTS" ]; do
+	ip netns add $NS-$i
+	ip link add pfb$i type veth peer name eth0 netns $NS-$i
+	ip addr add 10.201.$i.1/24 dev pfb$i
+	ip link set pfb$i up
+	ip -n $NS-$i addr add 10.201.$i.2/24 dev eth0
+	ip -n $NS-$i link set eth0 up
+	ip -n $NS-$i link set lo up
+	tc qdisc add dev pfb$i root netem delay $DELAY $JITTER loss $LOSS rate $RATE
+	tc -n $NS-$i qdisc add dev eth0 root netem delay $DELAY $JITTER loss $LOSS rate $RATE
+	echo 10.201.$i.2 >> "$WORK/hosts"
+	i=$((i + 1))
+done
+
+mkdir "$MNT"
+"$DIR/pingfs" $OPTS -M "$WORK/metrics" "$WORK/hosts" "$MNT" > "$WORK/pingfs.log" 2>&1 &
+PID=$!
+i=0
+while ! grep -q " $MNT fuse" /proc/mounts; do
+	i=$((i + 1))
+	if [ $i -gt 600 ] || ! kill -0 $PID 2>/dev/null; then
+		echo "pingfs did not mount:" >&2
+		cat "$WORK/pingfs.log" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+# Each workload is one fio job. pingfs has no directories, so files
+# are kept apart by the job name in front, and removed after the job
+run() {
+	name=$1
+	shift
+	fio --name="$name" --directory="$MNT" \
+		--filename_format='$jobname.$jobnum.$filenum' --output-format=json \
+		--output="$WORK/$name.json" "$@" >/dev/null
+	rm -f "$MNT/$name".*
+}
+
+TIMED="--time_based --runtime=$RUNTIME --ramp_time=1"
+run seqwrite --rw=write --bs=64k --size=$SIZE --ioengine=psync
+run seqread --rw=read --bs=64k --size=$SIZE --ioengine=psync $TIMED
+run randread --rw=randread --bs=4k --size=$SIZE --ioengine=psync $TIMED
+run randwrite --rw=randwrite --bs=4k --size=$SIZE --ioengine=psync $TIMED
+run create --ioengine=filecreate --nrfiles=$FILES --filesize=4k --openfiles=1
+run stat --ioengine=filestat --nrfiles=$FILES --filesize=4k --openfiles=1 \
+	--create_on_open=1 --loops=10
+
+# Summary of each job, latencies in microseconds
+summary() {
+	jq '
+	def side: if .total_ios > 0 then {
+			bytes_per_s: .bw_bytes, iops: .iops,
+			lat_us: (.clat_ns.percentile // {} | with_entries(.value /= 1000 |
+				.key |= "p" + sub("0+$"; "") | .key |= sub("\\.$"; "")))
+		} else null end;
+	.jobs[0] | { name: .jobname, read: (.read | side), write: (.write | side) }
+	' "$1"
+}
+
+metrics=null
+if command -v nc >/dev/null; then
+	metrics=$(echo json | nc -U -q 1 "$WORK/metrics" 2>/dev/null || true)
+	[ -n "$metrics" ] || metrics=null
+fi
+for job in seqwrite seqread randread randwrite create stat; do
+	summary "$WORK/$job.json"
+done | jq -s --arg hosts "$HOSTS" --arg delay "$DELAY" --arg loss "$LOSS" \
+	--arg rate "$RATE" --arg opts "$OPTS" --argjson metrics "$metrics" '{
+		setup: { hosts: ($hosts | tonumber), delay: $delay, loss: $loss,
+			rate: $rate, options: $opts },
+		workloads: .,
+		counters: ($metrics.counters // null)
+	}' > "$OUT"
+cat "$OUT"
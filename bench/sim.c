@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Runs the chunk and fs code against a simulated network in virtual
+ * time. Writes a set of files, reads random chunks back, and prints
+ * how long it took in virtual time */
+
+#include "host.h"
+#include "net.h"
+#include "chunk.h"
+#include "sim.h"
+#include "timer.h"
+#include "metrics.h"
+#include "fs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+/* Wait this long for room on the hosts */
+#define FULL_SLEEP_US 10000
+/* Give up writing after this long without room */
+#define FULL_GIVE_UP_US 60000000ULL
+
+static struct {
+	int hosts;
+	int files;
+	int size;
+	int reads;
+	uint64_t seed;
+	struct sim_model model;
+	const char *json;
+	int list_hosts;
+} opts = {
+	.hosts = 1000,
+	.files = 100,
+	.size = 16384,
+	.reads = 10000,
+	.seed = 1,
+	.model = {
+		.rtt_us = 50000,
+		.jitter_us = 5000,
+		.reorder_us = 20000,
+		.burst = 10,
+	},
+};
+
+static uint64_t rng;
+
+/* xorshift64, for the workload */
+static uint32_t next_rand()
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng >> 32;
+}
+
+static uint64_t wall_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint8_t pattern(int file, int offset)
+{
+	return (file * 31 + offset / CHUNK_SIZE * 7 + offset) & 0xff;
+}
+
+/* Hosts at 10.0.0.0/8, with round trip times spread from half
+ * to 1.5 times the one given */
+static struct host *make_hosts()
+{
+	struct host *hosts = NULL;
+	struct host **tail = &hosts;
+	int i;
+
+	for (i = 0; i < opts.hosts; i++) {
+		struct host *h = calloc(1, sizeof(*h));
+		struct sockaddr_in *sin = (struct sockaddr_in *) &h->sockaddr;
+		struct sim_model m = opts.model;
+
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(0x0a000001 + i);
+		h->sockaddr_len = sizeof(*sin);
+		m.rtt_us = m.rtt_us / 2 + (uint64_t) m.rtt_us * (next_rand() % 1000) / 1000;
+		sim_add_host(h, &m);
+		*tail = h;
+		tail = &h->next;
+	}
+	return hosts;
+}
+
+static int write_files(uint64_t *stalls)
+{
+	uint8_t buf[CHUNK_SIZE];
+	char name[32];
+	int errors = 0;
+	int f;
+
+	for (f = 0; f < opts.files; f++) {
+		int offset = 0;
+		uint64_t full_since = 0;
+
+		snprintf(name, sizeof(name), "/file%d", f);
+		fs_mknod(name, S_IFREG | 0644);
+		while (offset < opts.size) {
+			int len = opts.size - offset;
+			int res;
+			int i;
+
+			if (len > CHUNK_SIZE)
+				len = CHUNK_SIZE;
+			for (i = 0; i < len; i++)
+				buf[i] = pattern(f, offset + i);
+			res = fs_write(name, (char *) buf, len, offset);
+			if (res == -ENOSPC) {
+				/* All windows full, wait for replies */
+				if (!full_since)
+					full_since = timer_now_us();
+				if (timer_now_us() - full_since > FULL_GIVE_UP_US) {
+					fprintf(stderr, "No room for %s\n", name);
+					errors++;
+					break;
+				}
+				(*stalls)++;
+				sim_sleep(FULL_SLEEP_US);
+				continue;
+			}
+			full_since = 0;
+			if (res <= 0) {
+				errors++;
+				break;
+			}
+			offset += res;
+		}
+	}
+	return errors;
+}
+
+static int read_files()
+{
+	int chunks = (opts.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	uint8_t buf[CHUNK_SIZE];
+	char name[32];
+	int errors = 0;
+	int r;
+
+	for (r = 0; r < opts.reads; r++) {
+		int f = next_rand() % opts.files;
+		int offset = (next_rand() % chunks) * CHUNK_SIZE;
+		int res;
+		int i;
+
+		snprintf(name, sizeof(name), "/file%d", f);
+		res = fs_read(name, (char *) buf, CHUNK_SIZE, offset);
+		if (res <= 0) {
+			errors++;
+			continue;
+		}
+		for (i = 0; i < res; i++) {
+			if (buf[i] != pattern(f, offset + i)) {
+				errors++;
+				break;
+			}
+		}
+	}
+	return errors;
+}
+
+static void print_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		" -n hosts     : Echo hosts (default %d)\n"
+		" -f files     : Files to write (default %d)\n"
+		" -s bytes     : Size of each file (default %d)\n"
+		" -r reads     : Chunks to read back (default %d)\n"
+		" -S seed      : Random seed (default %llu)\n"
+		" -R us        : Mean round trip time, hosts get 0.5 to 1.5 times it (default %u)\n"
+		" -j us        : Mean exponential jitter (default %u)\n"
+		" -l ratio     : Loss each way (default 0)\n"
+		" -o ratio     : Share of replies delayed -O us more (default 0)\n"
+		" -O us        : Reordering delay (default %u)\n"
+		" -p pps       : Replies per second per host, 0 for no limit (default 0)\n"
+		" -b packets   : Burst over the rate (default %u)\n"
+		" -J file      : Write metrics JSON to file\n"
+		" -H           : List hosts in metrics JSON\n",
+		progname, opts.hosts, opts.files, opts.size, opts.reads,
+		(unsigned long long) opts.seed, opts.model.rtt_us, opts.model.jitter_us,
+		opts.model.reorder_us, opts.model.burst);
+}
+
+int main(int argc, char **argv)
+{
+	struct host *hosts;
+	uint64_t stalls = 0;
+	uint64_t start, wrote, read;
+	uint64_t wall;
+	int write_errors;
+	int read_errors;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:f:s:r:S:R:j:l:o:O:p:b:J:H")) != -1) {
+		switch (c) {
+		case 'n': opts.hosts = atoi(optarg); break;
+		case 'f': opts.files = atoi(optarg); break;
+		case 's': opts.size = atoi(optarg); break;
+		case 'r': opts.reads = atoi(optarg); break;
+		case 'S': opts.seed = strtoull(optarg, NULL, 0); break;
+		case 'R': opts.model.rtt_us = atoi(optarg); break;
+		case 'j': opts.model.jitter_us = atoi(optarg); break;
+		case 'l': opts.model.loss = atof(optarg); break;
+		case 'o': opts.model.reorder = atof(optarg); break;
+		case 'O': opts.model.reorder_us = atoi(optarg); break;
+		case 'p': opts.model.rate_pps = atoi(optarg); break;
+		case 'b': opts.model.burst = atoi(optarg); break;
+		case 'J': opts.json = optarg; break;
+		case 'H': opts.list_hosts = 1; break;
+		default:
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (opts.hosts < 1 || opts.files < 1 || opts.size < 1 || opts.reads < 0) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	rng = opts.seed * 2 + 1;
+	sim_enable(opts.seed);
+	sim_set_default(&opts.model);
+	hosts = make_hosts();
+	host_set_timeout(1);
+	chunk_set_timeout(1);
+	net_open_sockets();
+	host_use(hosts);
+	/* Hold the clock before the network thread starts */
+	sim_enter();
+	net_start();
+
+	wall = wall_us();
+	start = timer_now_us();
+	write_errors = write_files(&stalls);
+	wrote = timer_now_us();
+	read_errors = read_files();
+	read = timer_now_us();
+	wall = wall_us() - wall;
+	/* While the clock is held, so it only depends on the seed */
+	if (opts.json) {
+		FILE *f = fopen(opts.json, "w");
+		if (f) {
+			metrics_dump(f, opts.list_hosts ? hosts : NULL);
+			fclose(f);
+		} else {
+			perror("Failed to write metrics");
+		}
+	}
+	sim_exit();
+
+	printf("Simulated %d hosts, seed %llu\n", opts.hosts, (unsigned long long) opts.seed);
+	printf("write: %d files of %d bytes in %.3f s, %llu stalls for room, %d errors\n",
+		opts.files, opts.size, (wrote - start) / 1e6,
+		(unsigned long long) stalls, write_errors);
+	printf("read:  %d chunks in %.3f s, %.1f chunks/s, %d errors\n",
+		opts.reads, (read - wrote) / 1e6,
+		read > wrote ? opts.reads / ((read - wrote) / 1e6) : 0.0, read_errors);
+	printf("%.3f s of virtual time in %.3f s, %.1fx real time\n",
+		(read - start) / 1e6, wall / 1e6, wall ? (double) (read - start) / wall : 0.0);
+	net_stop();
+	return (write_errors || read_errors) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "cache.h"
+#include "chunk.h"
+#include "health.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#define CACHE_HEADER "# pingfs host cache v1"
+
+int cache_load(const char *path, const char *hostfile, struct host **hosts)
+{
+	struct host *last = NULL;
+	struct stat cache_st;
+	struct stat host_st;
+	char line[512];
+	FILE *file;
+	int count = 0;
+
+	*hosts = NULL;
+	if (stat(path, &cache_st))
+		return 0;
+	if (strcmp("-", hostfile) != 0 && stat(hostfile, &host_st) == 0 &&
+		host_st.st_mtime > cache_st.st_mtime) {
+		fprintf(stderr, "Host file is newer than cache, not using it\n");
+		return 0;
+	}
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror("Failed to read host cache");
+		return 0;
+	}
+	if (!fgets(line, sizeof(line), file) ||
+		strncmp(line, CACHE_HEADER, strlen(CACHE_HEADER)) != 0) {
+		fprintf(stderr, "Bad host cache file, not using it\n");
+		fclose(file);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		struct addrinfo hints;
+		struct addrinfo *res;
+		struct host *h;
+		char addr[NI_MAXHOST];
+		unsigned srtt, rttvar, min_rtt, cwnd, payload;
+		double loss;
+
+		if (sscanf(line, "%511s %u %u %u %lf %u %u", addr, &srtt, &rttvar,
+			&min_rtt, &loss, &cwnd, &payload) != 7)
+			continue;
+		/* Only use hosts tested with full chunks */
+		if (payload < CHUNK_SIZE)
+			continue;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_flags = AI_NUMERICHOST;
+		hints.ai_socktype = SOCK_RAW;
+		if (getaddrinfo(addr, NULL, &hints, &res))
+			continue;
+
+		h = calloc(1, sizeof(struct host));
+		if (!h) {
+			freeaddrinfo(res);
+			break;
+		}
+		memcpy(&h->sockaddr, res->ai_addr, res->ai_addrlen);
+		h->sockaddr_len = res->ai_addrlen;
+		freeaddrinfo(res);
+
+		h->min_rtt_us = min_rtt;
+		h->loss = loss;
+		/* Old estimates only seed the new ones */
+		if (srtt) {
+			host_rtt_sample(h, srtt);
+			h->rttvar_us = MAX(h->rttvar_us, rttvar);
+		}
+		if (cwnd) {
+			h->cwnd = cwnd;
+			h->ssthresh = cwnd;
+			h->cwnd_chunks = cwnd;
+		}
+		health_known_host(h);
+
+		if (!*hosts)
+			*hosts = h;
+		if (last)
+			last->next = h;
+		last = h;
+		count++;
+	}
+	fclose(file);
+	return count;
+}
+
+int cache_save(const char *path, struct host *hosts)
+{
+	char tmppath[4096];
+	FILE *file;
+	struct host *h;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	file = fopen(tmppath, "w");
+	if (!file) {
+		perror("Failed to write host cache");
+		return 1;
+	}
+
+	fprintf(file, CACHE_HEADER "\n");
+	fprintf(file, "# address srtt_us rttvar_us min_rtt_us loss cwnd payload\n");
+	for (h = hosts; h; h = h->next) {
+		char addr[NI_MAXHOST];
+
+		/* Hosts in use, and ones not checked yet. Loaded
+		 * hosts are probed before use */
+		if (h->state != HOST_OK && h->state != HOST_CANDIDATE)
+			continue;
+		if (getnameinfo((struct sockaddr *) &h->sockaddr, h->sockaddr_len,
+			addr, sizeof(addr), NULL, 0, NI_NUMERICHOST))
+			continue;
+		fprintf(file, "%s %u %u %u %.04f %u %u\n", addr, h->srtt_us,
+			h->rttvar_us, h->min_rtt_us, h->loss,
+			(unsigned) h->cwnd, CHUNK_SIZE);
+	}
+
+	if (fclose(file) || rename(tmppath, path)) {
+		perror("Failed to write host cache");
+		unlink(tmppath);
+		return 1;
+	}
+	return 0;
+}
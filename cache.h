@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_CACHE_H_
+#define PINGFS_CACHE_H_
+
+#include "host.h"
+
+/* Host cache file, keeps evaluated hosts and their estimates
+ * between mounts so evaluation can be skipped. */
+
+/* Load hosts from cache file, unless the host file is newer.
+ * Returns number of hosts, or 0 if the cache can not be used */
+int cache_load(const char *path, const char *hostfile, struct host **hosts);
+
+/* Write hosts to cache file. Returns nonzero on failure */
+int cache_save(const char *path, struct host *hosts);
+
+#endif /* PINGFS_CACHE_H_ */
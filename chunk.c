@@ -16,7 +16,18 @@
 #include "chunk.h"
 #include "host.h"
 #include "net.h"
+#include "stats.h"
+#include "sched.h"
+#include "health.h"
+#include "crc32c.h"
+#include "aead.h"
+#include "metrics.h"
+#include "trace.h"
+#include "sim.h"
+#include "pacer.h"
 
+#include <stddef.h>
+#include <string.h>
 #include <time.h>
 #include <pthread.h>
 #include <errno.h>
@@ -24,6 +35,10 @@
 enum io_owner {
 	OWNER_FS = 1,
 	OWNER_NET = 2,
+	/* Reader timed out, it frees io */
+	OWNER_GONE = 3,
+	/* Data failed to decrypt, reader gets -EIO and frees io */
+	OWNER_FAILED = 4,
 };
 
 struct io {
@@ -31,169 +46,622 @@ struct io {
 	pthread_cond_t net_cond;
 	pthread_mutex_t mutex;
 	enum io_owner owner;
+	/* Next reader queued on the chunk */
+	struct io *next;
 	uint8_t *data;
 	size_t len;
+	/* Set by chunk_done(), data must be sent anew */
+	int changed;
+	/* Simulation driver is blocked, waking it stops time */
+	int sim;
 };
 
-static uint16_t icmp_id;
+/* Ids from PROBE_ID_MIN up are for health probes, so they never
+ * shadow file data. Probes cycle through them, with the seqno
+ * making each one unique */
+#define PROBE_ID_MIN 0xF000
+#define PROBE_IDS (0x10000 - PROBE_ID_MIN)
+
 static int timeout;
 
-static struct chunk *chunk_head;
+/* Active chunks by id. File chunks get ids not in use, protected
+ * by chunk_mutex, so only probes can share a chain */
+static struct chunk *by_id[0x10000];
+static uint32_t ids_used[PROBE_ID_MIN / 32];
+static uint16_t next_id;
+static uint32_t probe_count;
+/* File data chunks in the active list, and their total length */
+static uint64_t active_chunks;
+static uint64_t active_bytes;
 static pthread_mutex_t chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Traced, to see time spent waiting for other threads */
+static void lock_chunks()
+{
+	TRACE(TRACE_LOCK_BEGIN, 0);
+	pthread_mutex_lock(&chunk_mutex);
+	TRACE(TRACE_LOCK_END, 0);
+}
+
+/* Deadlines of all active chunks, protected by chunk_mutex */
+static struct timer_wheel wheel;
+static int wheel_ready;
+
+/* Each access adds HEAT_UNIT to the heat of a chunk */
+#define HEAT_UNIT 16
+#define HEAT_HALFLIFE_US 10000000ULL
+/* Chunks read this often are moved to fast hosts */
+#define HEAT_HOT (4 * HEAT_UNIT)
+/* Chunks not read for this long are moved to slow hosts */
+#define COLD_AGE_US 30000000ULL
+/* Chunks stay on a host at least this long after being moved */
+#define MIGRATE_DWELL_US 5000000ULL
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
 void chunk_set_timeout(int t)
 {
 	timeout = t;
 }
 
+static void chunk_expired(struct timer *t);
+
+/* Must hold io->mutex */
+static void io_wake(struct io *io)
+{
+	if (io->sim) {
+		sim_unblock();
+		io->sim = 0;
+	}
+	pthread_cond_signal(&io->fs_cond);
+}
+
+/* Absolute CLOCK_REALTIME time us from now */
+static void deadline_ts(struct timespec *ts, uint64_t us)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Must hold chunk_mutex */
+static void arm_timer_us(struct chunk *c, uint64_t now, uint64_t us)
+{
+	if (!wheel_ready) {
+		timer_wheel_init(&wheel, now);
+		wheel_ready = 1;
+	}
+	timer_add(&wheel, &c->timer, now + us);
+}
+
+/* Must hold chunk_mutex */
+static void arm_timer(struct chunk *c, uint64_t now)
+{
+	arm_timer_us(c, now, host_rto_us(c->host));
+}
+
+/* Must hold chunk_mutex, call when sending packet */
+static void chunk_sent(struct chunk *c)
+{
+	if (c->host)
+		__atomic_fetch_add(&c->host->sent, 1, __ATOMIC_RELAXED);
+	c->sent_us = timer_now_us();
+	/* A paced packet can wait in the queue. Its RTT and
+	 * reply timer start in chunk_on_wire() */
+	if (pacer_enabled())
+		arm_timer_us(c, c->sent_us, timeout * 1000000ULL);
+	else
+		arm_timer(c, c->sent_us);
+}
+
+/* Must hold chunk_mutex. Next free id after the last one given,
+ * so a freed id is not reused right away */
+/* Returns -1 when all are taken */
+static int alloc_id()
+{
+	int i;
+
+	for (i = 0; i < PROBE_ID_MIN; i++) {
+		uint16_t id = next_id;
+
+		next_id = (next_id + 1) % PROBE_ID_MIN;
+		if (!(ids_used[id / 32] & (1U << (id % 32)))) {
+			ids_used[id / 32] |= 1U << (id % 32);
+			return id;
+		}
+	}
+	return -1;
+}
+
+void chunk_on_wire(uint16_t id, uint16_t seqno)
+{
+	struct chunk *c;
+
+	lock_chunks();
+	for (c = by_id[id]; c; c = c->next_id) {
+		if (c->seqno == seqno) {
+			c->sent_us = timer_now_us();
+			arm_timer(c, c->sent_us);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&chunk_mutex);
+}
+
 struct chunk *chunk_create()
 {
 	struct chunk *c;
+	int id;
 
 	c = calloc(1, sizeof(*c));
 	if (!c)
 		return NULL;
 
-	/* TODO can give duplicate ids after some time
-	 * if objects have varying lifetime */
-	c->id = icmp_id++;
+	lock_chunks();
+	id = alloc_id();
+	pthread_mutex_unlock(&chunk_mutex);
+	if (id < 0) {
+		free(c);
+		errno = ENOSPC;
+		return NULL;
+	}
+	c->id = id;
+	timer_init(&c->timer, chunk_expired);
 
 	return c;
 }
 
+/* Probes are freed with chunk_mutex held, and have no id to give back */
 void chunk_free(struct chunk *c)
 {
+	if (!(c->flags & CHUNK_PROBE)) {
+		lock_chunks();
+		ids_used[c->id / 32] &= ~(1U << (c->id % 32));
+		pthread_mutex_unlock(&chunk_mutex);
+	}
 	free(c);
 }
 
 void chunk_add(struct chunk *c)
 {
-	pthread_mutex_lock(&chunk_mutex);
-	c->next_active = chunk_head;
-	chunk_head = c;
+	lock_chunks();
+	c->next_id = by_id[c->id];
+	by_id[c->id] = c;
+	if (c->host)
+		__atomic_fetch_add(&c->host->chunks, 1, __ATOMIC_RELAXED);
+	if (!(c->flags & CHUNK_PROBE)) {
+		__atomic_fetch_add(&active_chunks, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&active_bytes, c->len, __ATOMIC_RELAXED);
+	}
+	/* Caller sends the first packet right after */
+	chunk_sent(c);
+	c->heat_us = c->access_us = c->moved_us = c->sent_us;
 	pthread_mutex_unlock(&chunk_mutex);
 }
 
-void chunk_remove(struct chunk *c)
+/* Must hold chunk_mutex */
+static void unlink_chunk(struct chunk *c)
 {
-	struct chunk *prev, *curr;
+	int found = 0;
+	struct chunk **curr;
 
-	prev = NULL;
-	pthread_mutex_lock(&chunk_mutex);
-	curr = chunk_head;
-	while (curr) {
-		if (curr == c) {
-			if (prev) {
-				prev->next_active = curr->next_active;
-			} else {
-				chunk_head = curr->next_active;
-			}
+	for (curr = &by_id[c->id]; *curr; curr = &(*curr)->next_id) {
+		if (*curr == c) {
+			*curr = c->next_id;
+			found = 1;
 			break;
 		}
-		prev = curr;
-		curr = curr->next_active;
 	}
+	if (wheel_ready)
+		timer_del(&wheel, &c->timer);
+	if (found && c->host)
+		__atomic_fetch_sub(&c->host->chunks, 1, __ATOMIC_RELAXED);
+	if (found && !(c->flags & CHUNK_PROBE)) {
+		__atomic_fetch_sub(&active_chunks, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&active_bytes, c->len, __ATOMIC_RELAXED);
+	}
+}
+
+void chunk_totals(uint64_t *chunks, uint64_t *bytes)
+{
+	*chunks = __atomic_load_n(&active_chunks, __ATOMIC_RELAXED);
+	*bytes = __atomic_load_n(&active_bytes, __ATOMIC_RELAXED);
+}
+
+void chunk_remove(struct chunk *c)
+{
+	lock_chunks();
+	unlink_chunk(c);
 	pthread_mutex_unlock(&chunk_mutex);
 }
 
-static void process_chunk(struct chunk *c, uint8_t **data)
+/* Called with chunk_mutex held. Expiry after the RTO marks the chunk
+ * overdue. A late reply can still come, so file data is only given up
+ * on at the timeout ceiling. Probes are given up on after another RTO */
+static void chunk_expired(struct timer *t)
 {
-	c->seqno++;
-	if (c->io) {
-		struct io *io = c->io;
+	struct chunk *c = container_of(t, struct chunk, timer);
+	uint64_t now = timer_now_us();
+	struct io *io;
+
+	if (!(c->flags & CHUNK_OVERDUE)) {
+		uint64_t ceiling = c->sent_us + timeout * 1000000ULL;
+
+		c->flags |= CHUNK_OVERDUE;
+		stats_inc(STAT_CHUNKS_OVERDUE);
+		if (c->host)
+			host_cc_loss(c->host, now);
+		if (c->flags & CHUNK_PROBE)
+			arm_timer(c, now);
+		else
+			arm_timer_us(c, now, ceiling > now ? ceiling - now : 0);
+		return;
+	}
+
+	c->flags |= CHUNK_LOST;
+	if (c->host)
+		__atomic_fetch_add(&c->host->lost, 1, __ATOMIC_RELAXED);
+	unlink_chunk(c);
+	if (c->flags & CHUNK_PROBE) {
+		health_probe_lost(c->host);
+		chunk_free(c);
+		return;
+	}
+	stats_inc(STAT_CHUNKS_LOST);
+	/* Wake up readers */
+	for (io = c->io; io; io = io->next) {
 		pthread_mutex_lock(&io->mutex);
-		io->data = *data;
-		io->len = c->len;
-		io->owner = OWNER_FS;
-		pthread_cond_signal(&io->fs_cond);
-		/* Wait while fs thread works, sets owner back and signals */
-		while (io->owner != OWNER_NET)
-			pthread_cond_wait(&io->net_cond, &io->mutex);
-		*data = io->data;
+		io_wake(io);
 		pthread_mutex_unlock(&io->mutex);
-		free(c->io);
-		c->io = NULL;
 	}
-	net_send(c->host, c->id, c->seqno, *data, c->len);
 }
 
-void chunk_reply(void *userdata, struct sockaddr_storage *addr,
-	size_t addrlen, uint16_t id, uint16_t seqno, uint8_t **data, size_t len)
+void chunk_probe(struct host *h, size_t len)
 {
+	uint8_t payload[CHUNK_SIZE];
 	struct chunk *c;
-	pthread_mutex_lock(&chunk_mutex);
-	c = chunk_head;
-	while (c) {
-		if (c->id == id) {
-			net_inc_rx(len);
-			if (len == c->len && seqno == c->seqno) {
-				process_chunk(c, data);
+	uint32_t n;
+	size_t i;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return;
+	n = __atomic_fetch_add(&probe_count, 1, __ATOMIC_RELAXED);
+	c->id = PROBE_ID_MIN + n % PROBE_IDS;
+	c->seqno = n / PROBE_IDS;
+	timer_init(&c->timer, chunk_expired);
+	for (i = 0; i < len; i++)
+		payload[i] = i & 0xff;
+	c->flags = CHUNK_PROBE;
+	c->len = len;
+	c->crc = crc32c(0, payload, len);
+	c->host = h;
+	chunk_add(c);
+	net_send(c->host, c->id, c->seqno, payload, c->len);
+}
+
+void chunk_check_timers()
+{
+	lock_chunks();
+	if (wheel_ready)
+		timer_run(&wheel, timer_now_us());
+	pthread_mutex_unlock(&chunk_mutex);
+}
+
+/* Must hold chunk_mutex */
+static uint32_t chunk_heat(struct chunk *c, uint64_t now)
+{
+	uint64_t halflives = (now - c->heat_us) / HEAT_HALFLIFE_US;
+
+	if (halflives) {
+		c->heat = (halflives >= 32) ? 0 : c->heat >> halflives;
+		c->heat_us += halflives * HEAT_HALFLIFE_US;
+	}
+	return c->heat;
+}
+
+/* Must hold chunk_mutex */
+static void chunk_touch(struct chunk *c)
+{
+	uint64_t now = timer_now_us();
+
+	c->heat = chunk_heat(c, now) + HEAT_UNIT;
+	c->access_us = now;
+}
+
+/* Get better host for a hot or cold chunk, or NULL to stay.
+ * Only moves when the RTT differs by a third, to avoid
+ * chunks moving back and forth */
+static struct host *migrate_target(struct chunk *c, uint64_t now)
+{
+	struct host *h = NULL;
+
+	if (c->host && c->host->state == HOST_QUARANTINED) {
+		/* Evacuate */
+		h = sched_pick();
+		return (h && h != c->host) ? h : NULL;
+	}
+	if (!c->host || !c->host->srtt_us || now - c->moved_us < MIGRATE_DWELL_US)
+		return NULL;
+
+	if (chunk_heat(c, now) >= HEAT_HOT) {
+		h = sched_fast_host();
+		if (h && host_has_room(h) && (uint64_t) h->srtt_us * 4 < (uint64_t) c->host->srtt_us * 3)
+			return h;
+	} else if (now - c->access_us > COLD_AGE_US) {
+		h = sched_slow_host();
+		if (h && (uint64_t) h->srtt_us * 3 > (uint64_t) c->host->srtt_us * 4)
+			return h;
+	}
+	return NULL;
+}
+
+/* Must hold chunk_mutex */
+static void move_chunk(struct chunk *c, struct host *h, uint64_t now)
+{
+	__atomic_fetch_sub(&c->host->chunks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->chunks, 1, __ATOMIC_RELAXED);
+	c->host = h;
+	c->moved_us = now;
+	stats_inc(STAT_CHUNKS_MIGRATED);
+}
+
+/* Encrypt data in place if enabled, and update the CRC */
+static void seal_chunk(struct chunk *c, uint8_t *data)
+{
+	if (aead_enabled())
+		c->nonce = aead_seal(data, c->len, c->tag);
+	c->crc = crc32c(0, data, c->len);
+}
+
+void chunk_send(struct chunk *c, const uint8_t *data)
+{
+	uint8_t buf[CHUNK_SIZE];
+
+	memcpy(buf, data, c->len);
+	seal_chunk(c, buf);
+	net_send(c->host, c->id, c->seqno, buf, c->len);
+}
+
+static void process_chunk(struct chunk *c, uint16_t csum, uint8_t **data)
+{
+	/* Receive buffer can not grow, give fs a full chunk */
+	uint8_t buf[CHUNK_SIZE];
+	struct host *target;
+	uint64_t now;
+	int changed = 0;
+	int failed = 0;
+
+	/* Only decrypt when someone is waiting for the data. Forged or
+	 * corrupted, but matching the CRC: this is the only copy, so
+	 * it goes on as it is and the reader gets an error */
+	if (c->io && aead_enabled() &&
+		aead_open(c->nonce, *data, buf, c->len, c->tag)) {
+		stats_inc(STAT_PAYLOAD_ERRORS);
+		failed = 1;
+	}
+	if (c->flags & CHUNK_OVERDUE) {
+		c->flags &= ~CHUNK_OVERDUE;
+		stats_inc(STAT_CHUNKS_RECOVERED);
+	}
+	c->seqno++;
+	/* Resend to a better host as the chunk passes */
+	now = timer_now_us();
+	target = migrate_target(c, now);
+	if (target)
+		move_chunk(c, target, now);
+	if (c->io) {
+		struct io *io;
+		TRACE(TRACE_HANDOFF_BEGIN, c->id);
+		if (!failed && !aead_enabled())
+			memcpy(buf, *data, c->len);
+		/* Queued readers take turns with this pass, each sees
+		 * what the one before wrote */
+		while ((io = c->io)) {
+			pthread_mutex_lock(&io->mutex);
+			if (io->owner == OWNER_GONE) {
+				/* Reader frees it */
+				c->io = io->next;
+				pthread_mutex_unlock(&io->mutex);
+			} else if (failed) {
+				c->io = io->next;
+				io->owner = OWNER_FAILED;
+				io_wake(io);
+				pthread_mutex_unlock(&io->mutex);
+			} else {
+				io->data = buf;
+				io->len = c->len;
+				io->owner = OWNER_FS;
+				io_wake(io);
+				/* Wait while fs thread works, sets owner back and signals */
+				while (io->owner != OWNER_NET)
+					pthread_cond_wait(&io->net_cond, &io->mutex);
+				pthread_mutex_unlock(&io->mutex);
+				changed |= io->changed;
+				c->io = io->next;
+				free(io);
 			}
-			break;
 		}
-		c = c->next_active;
+		TRACE(TRACE_HANDOFF_END, c->id);
+	}
+	if (changed) {
+		seal_chunk(c, buf);
+		net_send(c->host, c->id, c->seqno, buf, c->len);
+	} else if (target) {
+		/* Reply checksum might be from other address family */
+		net_send(c->host, c->id, c->seqno, *data, c->len);
+	} else {
+		/* Pass on the payload as it came, encrypted or not */
+		net_resend(c->host, c->id, c->seqno, *data, c->len, c->seqno - 1, csum);
 	}
+	chunk_sent(c);
+}
+
+void chunk_reply(void *userdata, struct sockaddr_storage *addr,
+	size_t addrlen, uint16_t id, uint16_t seqno, uint16_t csum, uint8_t **data, size_t len)
+{
+	struct chunk *c;
+	int known = 0;
+	TRACE(TRACE_RECV, id << 16 | seqno);
+	lock_chunks();
+	for (c = by_id[id]; c; c = c->next_id) {
+		known = 1;
+		if (c->seqno == seqno)
+			break;
+	}
+	if (!known)
+		goto out;
+	net_inc_rx(len);
+	if (!c || len != c->len) {
+		stats_inc(STAT_SEQNO_MISMATCH);
+		goto out;
+	}
+	if (crc32c(0, *data, len) != c->crc) {
+		/* Corrupt or spoofed, wait for a good copy or give up */
+		stats_inc(STAT_PAYLOAD_ERRORS);
+		goto out;
+	}
+	if (c->host) {
+		host_rtt_sample(c->host, timer_now_us() - c->sent_us);
+		host_cc_reply(c->host);
+	}
+	if (c->flags & CHUNK_PROBE) {
+		health_probe_reply(c->host);
+		unlink_chunk(c);
+		chunk_free(c);
+		goto out;
+	}
+	process_chunk(c, csum, data);
+out:
 	pthread_mutex_unlock(&chunk_mutex);
 }
 
+/* Take io out of the readers queued on c, if still there. Must
+ * hold chunk_mutex */
+static void unlink_io(struct chunk *c, struct io *io)
+{
+	struct io **p;
+
+	for (p = &c->io; *p; p = &(*p)->next) {
+		if (*p == io) {
+			*p = io->next;
+			return;
+		}
+	}
+}
+
 /* Call from fs thread to wait until chunk arrives or timeout.
  * When data comes from icmp it is pointed to in data argument,
  * and the function returns the length of it.
- * Must call chunk_done() after when done */
+ * Must call chunk_done() or chunk_release() after when done */
 int chunk_wait_for(struct chunk *c, uint8_t **data)
 {
-	pthread_mutex_lock(&chunk_mutex);
-	if (c->io) {
-		pthread_mutex_unlock(&chunk_mutex);
-		return -EBUSY;
-	}
+	struct io *io;
+	struct io **tail;
+	struct timespec ts;
+	uint64_t start_us;
+	uint64_t wait_us;
+	uint64_t now_us;
 
-	c->io = calloc(1, sizeof(struct io));
-	if (!c->io) {
-		pthread_mutex_unlock(&chunk_mutex);
+	start_us = timer_now_us();
+	io = calloc(1, sizeof(struct io));
+	if (!io)
 		return -ENOMEM;
+	io->owner = OWNER_NET;
+	pthread_cond_init(&io->fs_cond, NULL);
+	pthread_cond_init(&io->net_cond, NULL);
+	if (pthread_mutex_init(&io->mutex, NULL)) {
+		free(io);
+		return -errno;
 	}
 
-	pthread_mutex_unlock(&chunk_mutex);
-	c->io->owner = OWNER_NET;
-	pthread_cond_init(&c->io->fs_cond, NULL);
-	pthread_cond_init(&c->io->net_cond, NULL);
-	if (pthread_mutex_init(&c->io->mutex, NULL)) {
+	lock_chunks();
+	if (c->flags & CHUNK_LOST) {
 		pthread_mutex_unlock(&chunk_mutex);
-		free(c->io);
-		return -errno;
+		free(io);
+		return 0;
 	}
+	if (c->io)
+		stats_inc(STAT_WAIT_BUSY);
+	TRACE(TRACE_WAIT_BEGIN, c->id);
+	/* Fully set up before network thread can see it. Queued
+	 * behind other readers, they all get the next pass */
+	for (tail = &c->io; *tail; tail = &(*tail)->next)
+		;
+	*tail = io;
+	chunk_touch(c);
+	pthread_mutex_lock(&io->mutex);
+	pthread_mutex_unlock(&chunk_mutex);
 
-	pthread_mutex_lock(&c->io->mutex);
-	while (c->io->owner != OWNER_FS) {
+	/* Chunk should pass by within a round trip, but can be late.
+	 * Lost chunks are found by the timers at the timeout ceiling,
+	 * this is only a fallback */
+	wait_us = timeout * 1000000ULL;
+	deadline_ts(&ts, wait_us);
+	io->sim = sim_block();
+	while (io->owner == OWNER_NET) {
 		int res;
-		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += timeout;
-		res = pthread_cond_timedwait(&c->io->fs_cond,
-			&c->io->mutex, &ts);
-		if (res) {
-			/* Timeout, data is lost */
-			pthread_mutex_unlock(&c->io->mutex);
-			pthread_mutex_lock(&chunk_mutex);
-			free(c->io);
-			c->io = NULL;
+		res = pthread_cond_timedwait(&io->fs_cond,
+			&io->mutex, &ts);
+		if (io->owner != OWNER_NET)
+			break;
+		/* Simulated time can pass slower than the wall clock */
+		now_us = timer_now_us();
+		if (res == ETIMEDOUT && now_us - start_us < wait_us) {
+			deadline_ts(&ts, wait_us - (now_us - start_us));
+			continue;
+		}
+		if (res || (c->flags & CHUNK_LOST)) {
+			/* Timeout, data is lost. The network thread might be
+			 * waiting for chunk_mutex with io, tell it to skip */
+			TRACE(TRACE_WAIT_END, c->id);
+			if (res)
+				stats_inc(STAT_WAIT_TIMEOUTS);
+			io->owner = OWNER_GONE;
+			if (io->sim)
+				sim_unblock();
+			pthread_mutex_unlock(&io->mutex);
+			lock_chunks();
+			unlink_io(c, io);
+			free(io);
 			pthread_mutex_unlock(&chunk_mutex);
 			return 0;
 		}
 	}
 
+	TRACE(TRACE_WAIT_END, c->id);
+	if (io->owner == OWNER_FAILED) {
+		/* Network thread let go of io */
+		pthread_mutex_unlock(&io->mutex);
+		free(io);
+		return -EIO;
+	}
 	/* Still holding io->mutex here */
-	*data = c->io->data;
-	return c->io->len;
+	metrics_record(HIST_CHUNK_WAIT, timer_now_us() - start_us);
+	*data = io->data;
+	return io->len;
 }
 
 /* Put back new data, let net thread continue */
-void chunk_done(struct chunk *c, uint8_t *data, size_t len)
+void chunk_done(struct chunk *c, size_t len)
 {
-	c->io->data = data;
 	c->io->len = len;
+	__atomic_fetch_add(&active_bytes, len - c->len, __ATOMIC_RELAXED);
 	c->len = c->io->len;
+	c->io->changed = 1;
+	c->io->owner = OWNER_NET;
+
+	pthread_cond_signal(&c->io->net_cond);
+	pthread_mutex_unlock(&c->io->mutex);
+}
+
+void chunk_release(struct chunk *c)
+{
 	c->io->owner = OWNER_NET;
 
 	pthread_cond_signal(&c->io->net_cond);
@@ -16,6 +16,9 @@
 #ifndef PINGFS_CHUNK_H_
 #define PINGFS_CHUNK_H_
 
+#include "timer.h"
+#include "aead.h"
+
 #include <stdint.h>
 #include <sys/socket.h>
 
@@ -25,22 +28,50 @@ struct host;
 
 struct io;
 
+enum chunk_flags {
+	/* Reply did not arrive in time */
+	CHUNK_OVERDUE = 1,
+	/* Given up on, the data is gone */
+	CHUNK_LOST = 2,
+	/* Health probe, freed when it returns or is lost */
+	CHUNK_PROBE = 4,
+};
+
 struct chunk {
-	/* Link for list of all active chunks */
-	struct chunk *next_active;
+	/* Link for active chunks with the same id */
+	struct chunk *next_id;
 	/* Link for list of chunks in this same file */
 	struct chunk *next_file;
 	struct host *host;
+	/* Readers waiting for the next pass, in order */
 	struct io *io;
+	/* Deadline for the reply to the last sent packet */
+	struct timer timer;
+	uint64_t sent_us;
+	/* Access heat, halved every HEAT_HALFLIFE, and when it
+	 * was last decayed */
+	uint32_t heat;
+	uint64_t heat_us;
+	uint64_t access_us;
+	/* Last time chunk changed host */
+	uint64_t moved_us;
+	/* CRC32C of the data as sent, checked on every reply */
+	uint32_t crc;
+	/* Encryption nonce and tag, if enabled */
+	uint64_t nonce;
+	uint8_t tag[AEAD_TAGLEN];
 	uint16_t id;
 	uint16_t seqno;
 	uint16_t len;
+	uint8_t flags;
 };
 
-/* Set timeout (seconds) waiting for packets */
+/* Set max timeout (seconds) waiting for packets. Shorter
+ * timeouts are used for hosts with known round trip time */
 void chunk_set_timeout(int t);
 
-/* Allocate chunk and give it id and seqno */
+/* Allocate chunk and give it an id not used by another chunk.
+ * Returns NULL with errno ENOSPC when all ids are in use */
 struct chunk *chunk_create();
 
 void chunk_free(struct chunk *c);
@@ -49,12 +80,37 @@ void chunk_free(struct chunk *c);
 void chunk_add(struct chunk *c);
 void chunk_remove(struct chunk *c);
 
+/* Number of file data chunks in circulation, and their bytes */
+void chunk_totals(uint64_t *chunks, uint64_t *bytes);
+
+/* Flag chunks whose replies are overdue, and give up on
+ * them after a while. Call regularly from the network thread */
+void chunk_check_timers();
+
+/* Send first copy of chunk data, encrypted if enabled.
+ * Set len and host and add the chunk first */
+void chunk_send(struct chunk *c, const uint8_t *data);
+
+/* Send a probe packet of len bytes (max CHUNK_SIZE) to check on host */
+void chunk_probe(struct host *h, size_t len);
+
+/* Packet left a send queue, restart its reply timer */
+void chunk_on_wire(uint16_t id, uint16_t seqno);
+
 /* Handle icmp reply */
 void chunk_reply(void *userdata, struct sockaddr_storage *addr,
-	size_t addrlen, uint16_t id, uint16_t seqno, uint8_t **data, size_t len);
+	size_t addrlen, uint16_t id, uint16_t seqno, uint16_t csum, uint8_t **data, size_t len);
 
-/* Ask for chunk from network, put back result */
+/* Ask for chunk from network, put back result.
+ * The data buffer can be modified in place and has room
+ * for CHUNK_SIZE bytes. It is only valid until chunk_done()
+ * or chunk_release(). Readers of the same chunk queue up and
+ * take turns with the next pass. Returns 0 if the chunk is
+ * lost, and -EIO if it fails to decrypt, the chunk is kept */
 int chunk_wait_for(struct chunk *c, uint8_t **data);
-void chunk_done(struct chunk *c, uint8_t *data, size_t len);
+/* Data was changed in place, send len bytes of it */
+void chunk_done(struct chunk *c, size_t len);
+/* Put back chunk without changes, it is passed on as it came */
+void chunk_release(struct chunk *c);
 
 #endif /* PINGFS_CHUNK_H_ */
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC
+#endif
+
+/* Reflected Castagnoli polynomial */
+#define POLY 0x82f63b78
+
+/* Slicing-by-8 tables, table[k][b] is the crc of byte b
+ * followed by k zero bytes */
+static uint32_t table[8][256];
+
+static uint32_t (*crc_fn)(uint32_t crc, const uint8_t *data, size_t len);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t *data, size_t len)
+{
+	while (len && ((uintptr_t) data & 7)) {
+		crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t lo;
+		uint32_t hi;
+
+		memcpy(&lo, data, 4);
+		memcpy(&hi, data + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = __builtin_bswap32(lo);
+		hi = __builtin_bswap32(hi);
+#endif
+		lo ^= crc;
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+			table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+			table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+			table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+		data += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *data, size_t len)
+{
+	while (len && ((uintptr_t) data & 7)) {
+		crc = _mm_crc32_u8(crc, *data++);
+		len--;
+	}
+#ifdef __x86_64__
+	while (len >= 8) {
+		uint64_t w;
+		memcpy(&w, data, sizeof(w));
+		crc = (uint32_t) _mm_crc32_u64(crc, w);
+		data += 8;
+		len -= 8;
+	}
+#endif
+	while (len >= 4) {
+		uint32_t w;
+		memcpy(&w, data, sizeof(w));
+		crc = _mm_crc32_u32(crc, w);
+		data += 4;
+		len -= 4;
+	}
+	while (len--)
+		crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+#endif
+
+static void crc_init()
+{
+	uint32_t crc;
+	int i;
+	int j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (POLY & -(crc & 1));
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = table[0][crc & 0xff] ^ (crc >> 8);
+			table[j][i] = crc;
+		}
+	}
+
+	crc_fn = crc_sw;
+#ifdef HAVE_SSE42_CRC
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc_fn = crc_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+	return ~crc_fn(~crc, data, len);
+}
@@ -17,6 +17,9 @@
 #include "host.h"
 #include "net.h"
 #include "chunk.h"
+#include "timer.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <errno.h>
 #include <stdint.h>
@@ -25,15 +28,22 @@
 #include <unistd.h>
 #include <sys/param.h>
 #include <assert.h>
+#include <pthread.h>
 
 struct file {
 	struct file *next;
 	const char *name;
+	/* Chunks and mode, held across waits for chunks */
+	pthread_rwlock_t lock;
 	struct chunk *chunks;
 	mode_t mode;
+	/* One for the file list, and one for each operation using it */
+	int refs;
 };
 
-struct file *files;
+/* File list and names, only held briefly */
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct file *files;
 
 static void fs_free(struct file *f)
 {
@@ -46,6 +56,7 @@ static void fs_free(struct file *f)
 		chunk_free(c);
 		c = next;
 	}
+	pthread_rwlock_destroy(&f->lock);
 	free((void*) f->name);
 	free(f);
 }
@@ -63,25 +74,34 @@ static size_t file_size(struct file *f)
 	return size;
 }
 
-static void *fs_init(struct fuse_conn_info *conn)
+void fs_start()
 {
 	net_start();
-	return NULL;
 }
 
-static void fs_destroy(void *data)
+static void put_file(struct file *f)
+{
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		fs_free(f);
+}
+
+void fs_stop()
 {
 	struct file *f;
 
 	net_stop();
+	pthread_rwlock_wrlock(&fs_lock);
 	f = files;
+	files = NULL;
+	pthread_rwlock_unlock(&fs_lock);
 	while (f) {
 		struct file *next = f->next;
-		fs_free(f);
+		put_file(f);
 		f = next;
 	}
 }
 
+/* Must hold fs_lock */
 static struct file *find_file(const char *name)
 {
 	struct file *f;
@@ -95,12 +115,25 @@ static struct file *find_file(const char *name)
 	return NULL;
 }
 
-static int fs_mkdir(const char *name, mode_t mode)
+/* Find file and keep it from being freed, until put_file() */
+static struct file *get_file(const char *name)
+{
+	struct file *f;
+
+	pthread_rwlock_rdlock(&fs_lock);
+	f = find_file(name);
+	if (f)
+		__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&fs_lock);
+	return f;
+}
+
+static int do_mkdir(const char *name, mode_t mode)
 {
 	return -ENOTSUP;
 }
 
-static int fs_mknod(const char *name, mode_t mode, dev_t device)
+static int do_mknod(const char *name, mode_t mode)
 {
 	struct file *f;
 
@@ -108,47 +141,56 @@ static int fs_mknod(const char *name, mode_t mode, dev_t device)
 	if (!S_ISREG(mode))
 		return -ENOTSUP;
 
-	f = find_file(name);
-	if (f)
-		return -EEXIST;
-
 	f = calloc(1, sizeof(struct file));
 	if (!f)
 		return -errno;
-
 	f->name = strdup(name);
 	f->mode = mode;
+	f->refs = 1;
+	pthread_rwlock_init(&f->lock, NULL);
+
+	pthread_rwlock_wrlock(&fs_lock);
+	if (find_file(name)) {
+		pthread_rwlock_unlock(&fs_lock);
+		fs_free(f);
+		return -EEXIST;
+	}
 	f->next = files;
 	files = f;
+	pthread_rwlock_unlock(&fs_lock);
 
 	return 0;
 }
 
-static int fs_chmod(const char *name, mode_t mode)
+static int do_chmod(const char *name, mode_t mode)
 {
 	struct file *f;
 
-	f = find_file(name);
+	f = get_file(name);
 	if (!f)
 		return -ENOENT;
 
+	pthread_rwlock_wrlock(&f->lock);
 	f->mode = mode;
+	pthread_rwlock_unlock(&f->lock);
+	put_file(f);
 	return 0;
 }
 
-static int fs_utime(const char *name, struct utimbuf *utim)
+static int do_utime(const char *name, struct utimbuf *utim)
 {
 	struct file *f;
 
-	f = find_file(name);
+	f = get_file(name);
 	if (!f)
 		return -ENOENT;
 
 	/* No-op */
+	put_file(f);
 	return 0;
 }
 
-static int fs_getattr(const char *name, struct stat *stat)
+static int do_getattr(const char *name, struct stat *stat)
 {
 	struct file *f;
 
@@ -167,19 +209,26 @@ static int fs_getattr(const char *name, struct stat *stat)
 		return 0;
 	}
 
-	f = find_file(name);
+	f = get_file(name);
 	if (!f)
 		return -ENOENT;
 
+	pthread_rwlock_rdlock(&f->lock);
 	stat->st_mode = f->mode;
 	stat->st_size = file_size(f);
+	pthread_rwlock_unlock(&f->lock);
+	put_file(f);
 	return 0;
 }
 
-static int fs_unlink(const char *name)
+/* Freed when the last operation on it is done */
+static int do_unlink(const char *name)
 {
-	struct file *f = files;
+	struct file *f;
 	struct file *last = NULL;
+
+	pthread_rwlock_wrlock(&fs_lock);
+	f = files;
 	while (f) {
 		if (strcmp(name, f->name) == 0) {
 			if (last) {
@@ -187,43 +236,47 @@ static int fs_unlink(const char *name)
 			} else {
 				files = f->next;
 			}
-			fs_free(f);
+			pthread_rwlock_unlock(&fs_lock);
+			put_file(f);
 			return 0;
 		}
 		last = f;
 		f = f->next;
 	}
+	pthread_rwlock_unlock(&fs_lock);
 	return -ENOENT;
 }
 
-static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-	off_t offset, struct fuse_file_info *fi)
+static int do_readdir(const char *path, void *buf, fs_fill_fn filler)
 {
 	struct file *f;
 	if (strcmp("/", path)) {
 		return -ENOENT;
 	}
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	filler(buf, ".");
+	filler(buf, "..");
 
+	pthread_rwlock_rdlock(&fs_lock);
 	f = files;
 	while (f) {
 		/* Skip initial '/' in name */
-		filler(buf, &f->name[1], NULL, 0);
+		filler(buf, &f->name[1]);
 		f = f->next;
 	}
+	pthread_rwlock_unlock(&fs_lock);
 
 	return 0;
 }
 
-static int fs_open(const char *name, struct fuse_file_info *fileinfo)
+static int do_open(const char *name)
 {
 	struct file *f;
 
-	f = find_file(name);
+	f = get_file(name);
 	if (!f)
 		return -ENOENT;
 
+	put_file(f);
 	return 0;
 }
 
@@ -249,16 +302,21 @@ static int fs_inner_write(struct file *f, const char *buf, size_t size,
 	}
 	if (!c) {
 		/* Write to new chunk */
+		struct host *host = host_get_next();
+		if (!host)
+			return -ENOSPC;
 		c = chunk_create();
+		if (!c)
+			return -errno;
 		c->len = MIN(size, CHUNK_SIZE);
+		c->host = host;
 		chunk_add(c);
 
 		if (last)
 			last->next_file = c;
 		else
 			f->chunks = c;
-		c->host = host_get_next();
-		net_send(c->host, c->id, c->seqno, (const uint8_t *) buf, c->len);
+		chunk_send(c, (const uint8_t *) buf);
 
 		return c->len;
 	}
@@ -274,37 +332,37 @@ static int fs_inner_write(struct file *f, const char *buf, size_t size,
 	/* Number of bytes to write */
 	len = MIN(clen - offset, size);
 
-	chunkdata = realloc(chunkdata, clen);
+	/* Buffer has room for a full chunk, extend in place */
 	memcpy(&chunkdata[offset], buf, len);
-	chunk_done(c, chunkdata, clen);
+	chunk_done(c, clen);
 	return len;
 }
 
-static int fs_write(const char *name, const char *buf, size_t size,
-	off_t offset, struct fuse_file_info *fileinfo)
+/* Writes to a file wait for each other, not for other files */
+static int do_write(const char *name, const char *buf, size_t size, off_t offset)
 {
 	struct file *f;
+	int res;
 
-	f = find_file(name);
+	f = get_file(name);
 	if (!f)
 		return -ENOENT;
 
-	return fs_inner_write(f, buf, size, offset);
+	pthread_rwlock_wrlock(&f->lock);
+	res = fs_inner_write(f, buf, size, offset);
+	pthread_rwlock_unlock(&f->lock);
+	put_file(f);
+	return res;
 }
 
-static int fs_read(const char *name, char *buf, size_t size,
-	off_t offset, struct fuse_file_info *fileinfo)
+/* Must hold f->lock */
+static int read_file(struct file *f, char *buf, size_t size, off_t offset)
 {
-	struct file *f;
 	struct chunk *c;
 	uint8_t *chunkdata;
 	int len;
 	int clen;
 
-	f = find_file(name);
-	if (!f)
-		return -ENOENT;
-
 	c = f->chunks;
 	while (c && offset >= c->len) {
 		offset -= c->len;
@@ -321,12 +379,32 @@ static int fs_read(const char *name, char *buf, size_t size,
 	clen = chunk_wait_for(c, &chunkdata);
 	if (!clen)
 		return -EIO;
+	if (clen < 0)
+		return clen;
 
 	memcpy(buf, &chunkdata[offset], len);
-	chunk_done(c, chunkdata, clen);
+	chunk_release(c);
 	return len;
 }
 
+/* Reads of a file only take its lock shared, so they can wait
+ * for chunks in parallel */
+static int do_read(const char *name, char *buf, size_t size, off_t offset)
+{
+	struct file *f;
+	int res;
+
+	f = get_file(name);
+	if (!f)
+		return -ENOENT;
+
+	pthread_rwlock_rdlock(&f->lock);
+	res = read_file(f, buf, size, offset);
+	pthread_rwlock_unlock(&f->lock);
+	put_file(f);
+	return res;
+}
+
 static int shrink_file(struct file *f, off_t length)
 {
 	struct chunk *c = f->chunks;
@@ -351,8 +429,10 @@ static int shrink_file(struct file *f, off_t length)
 			clen = chunk_wait_for(c, &cdata);
 			if (!clen)
 				return -EIO;
+			if (clen < 0)
+				return clen;
 
-			chunk_done(c, cdata, length);
+			chunk_done(c, length);
 			c->next_file = NULL;
 			length = 0;
 		} else {
@@ -383,15 +463,11 @@ static int grow_file(struct file *f, off_t length)
 	return 0;
 }
 
-static int fs_truncate(const char *name, off_t length)
+/* Must hold f->lock for writing */
+static int truncate_file(struct file *f, off_t length)
 {
-	struct file *f;
 	int cur_size;
 
-	f = find_file(name);
-	if (!f)
-		return -ENOENT;
-
 	cur_size = file_size(f);
 	if (length > cur_size)
 		return grow_file(f, length);
@@ -401,34 +477,107 @@ static int fs_truncate(const char *name, off_t length)
 	return 0;
 }
 
-static int fs_rename(const char *name, const char *newname)
+static int do_truncate(const char *name, off_t length)
 {
 	struct file *f;
+	int res;
 
-	f = find_file(name);
+	f = get_file(name);
 	if (!f)
 		return -ENOENT;
 
+	pthread_rwlock_wrlock(&f->lock);
+	res = truncate_file(f, length);
+	pthread_rwlock_unlock(&f->lock);
+	put_file(f);
+	return res;
+}
+
+static int do_rename(const char *name, const char *newname)
+{
+	struct file *f;
+
+	pthread_rwlock_wrlock(&fs_lock);
+	f = find_file(name);
+	if (!f) {
+		pthread_rwlock_unlock(&fs_lock);
+		return -ENOENT;
+	}
+
 	free((void*) f->name);
 	f->name = strdup(newname);
+	pthread_rwlock_unlock(&fs_lock);
 
 	return 0;
 }
 
-const struct fuse_operations fs_ops = {
-	.getattr = fs_getattr,
-	.utime = fs_utime,
-	.chmod = fs_chmod,
-	.mkdir = fs_mkdir,
-	.mknod = fs_mknod,
-	.unlink = fs_unlink,
-	.readdir = fs_readdir,
-	.open = fs_open,
-	.write = fs_write,
-	.read = fs_read,
-	.truncate = fs_truncate,
-	.rename = fs_rename,
-	.init = fs_init,
-	.destroy = fs_destroy,
-};
+/* Operations timed into their latency histograms */
+#define TIMED(hist, call) do { \
+		uint64_t start = timer_now_us(); \
+		int res; \
+		TRACE(TRACE_OP_BEGIN, hist); \
+		res = call; \
+		TRACE(TRACE_OP_END, hist); \
+		metrics_record(hist, timer_now_us() - start); \
+		return res; \
+	} while (0)
+
+int fs_getattr(const char *name, struct stat *stat)
+{
+	TIMED(HIST_OP_GETATTR, do_getattr(name, stat));
+}
+
+int fs_utime(const char *name, struct utimbuf *utim)
+{
+	TIMED(HIST_OP_UTIME, do_utime(name, utim));
+}
+
+int fs_chmod(const char *name, mode_t mode)
+{
+	TIMED(HIST_OP_CHMOD, do_chmod(name, mode));
+}
+
+int fs_mkdir(const char *name, mode_t mode)
+{
+	TIMED(HIST_OP_MKDIR, do_mkdir(name, mode));
+}
 
+int fs_mknod(const char *name, mode_t mode)
+{
+	TIMED(HIST_OP_MKNOD, do_mknod(name, mode));
+}
+
+int fs_unlink(const char *name)
+{
+	TIMED(HIST_OP_UNLINK, do_unlink(name));
+}
+
+int fs_readdir(const char *path, void *buf, fs_fill_fn filler)
+{
+	TIMED(HIST_OP_READDIR, do_readdir(path, buf, filler));
+}
+
+int fs_open(const char *name)
+{
+	TIMED(HIST_OP_OPEN, do_open(name));
+}
+
+int fs_write(const char *name, const char *buf, size_t size, off_t offset)
+{
+	TIMED(HIST_OP_WRITE, do_write(name, buf, size, offset));
+}
+
+int fs_read(const char *name, char *buf, size_t size, off_t offset)
+{
+	TIMED(HIST_OP_READ, do_read(name, buf, size, offset));
+}
+
+int fs_truncate(const char *name, off_t length)
+{
+	TIMED(HIST_OP_TRUNCATE, do_truncate(name, length));
+}
+
+int fs_rename(const char *name, const char *newname)
+{
+	TIMED(HIST_OP_RENAME, do_rename(name, newname));
+}
@@ -17,12 +17,36 @@
 #ifndef PINGFS_FS_H_
 #define PINGFS_FS_H_
 
-#define FUSE_USE_VERSION 26
-
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fuse.h>
+#include <utime.h>
+
+/* Filesystem operations on paths like "/name", with one flat
+ * directory. Return 0 or a byte count, or a negative errno.
+ * Safe to call from several threads. Each file has its own lock,
+ * held while waiting for chunks: reads of a file wait in parallel,
+ * writes to it one at a time. Other files are not held up */
+
+/* Called with each directory entry name */
+typedef int (*fs_fill_fn)(void *buf, const char *name);
+
+/* Start and stop the network thread. Stopping removes all files */
+void fs_start();
+void fs_stop();
 
-extern const struct fuse_operations fs_ops;
+int fs_getattr(const char *name, struct stat *stat);
+int fs_utime(const char *name, struct utimbuf *utim);
+int fs_chmod(const char *name, mode_t mode);
+int fs_mkdir(const char *name, mode_t mode);
+/* Create a regular file */
+int fs_mknod(const char *name, mode_t mode);
+int fs_unlink(const char *name);
+int fs_readdir(const char *path, void *buf, fs_fill_fn filler);
+int fs_open(const char *name);
+/* Read and write at most up to the end of one chunk */
+int fs_write(const char *name, const char *buf, size_t size, off_t offset);
+int fs_read(const char *name, char *buf, size_t size, off_t offset);
+int fs_truncate(const char *name, off_t length);
+int fs_rename(const char *name, const char *newname);
 
 #endif /* PINGFS_FS_H_ */
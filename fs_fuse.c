@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "fs_fuse.h"
+#include "fs.h"
+
+#include <stddef.h>
+
+struct fill_data {
+	fuse_fill_dir_t filler;
+	void *buf;
+};
+
+static int fill(void *buf, const char *name)
+{
+	struct fill_data *fill = (struct fill_data *) buf;
+
+	return fill->filler(fill->buf, name, NULL, 0);
+}
+
+static void *ops_init(struct fuse_conn_info *conn)
+{
+	fs_start();
+	return NULL;
+}
+
+static void ops_destroy(void *data)
+{
+	fs_stop();
+}
+
+static int ops_mknod(const char *name, mode_t mode, dev_t device)
+{
+	return fs_mknod(name, mode);
+}
+
+static int ops_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+	off_t offset, struct fuse_file_info *fi)
+{
+	struct fill_data data = { filler, buf };
+
+	return fs_readdir(path, &data, fill);
+}
+
+static int ops_open(const char *name, struct fuse_file_info *fileinfo)
+{
+	return fs_open(name);
+}
+
+static int ops_write(const char *name, const char *buf, size_t size,
+	off_t offset, struct fuse_file_info *fileinfo)
+{
+	return fs_write(name, buf, size, offset);
+}
+
+static int ops_read(const char *name, char *buf, size_t size,
+	off_t offset, struct fuse_file_info *fileinfo)
+{
+	return fs_read(name, buf, size, offset);
+}
+
+const struct fuse_operations fs_fuse_ops = {
+	.getattr = fs_getattr,
+	.utime = fs_utime,
+	.chmod = fs_chmod,
+	.mkdir = fs_mkdir,
+	.mknod = ops_mknod,
+	.unlink = fs_unlink,
+	.readdir = ops_readdir,
+	.open = ops_open,
+	.write = ops_write,
+	.read = ops_read,
+	.truncate = fs_truncate,
+	.rename = fs_rename,
+	.init = ops_init,
+	.destroy = ops_destroy,
+};
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "health.h"
+#include "chunk.h"
+#include "sched.h"
+
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#define HEALTH_PERIOD_US 1000000
+/* Quarantine when loss or RTT gets this bad */
+#define HEALTH_MAX_LOSS 0.2
+#define HEALTH_MAX_RTT_FACTOR 5
+/* Do not quarantine for RTT increases below this */
+#define HEALTH_MIN_RTT_US 20000
+/* Take back or admit after this many probe replies in a row */
+#define HEALTH_READMIT_PROBES 5
+/* Give up on new hosts after losing this many probes */
+#define HEALTH_REJECT_PROBES 2
+/* Max new hosts being probed at once, and candidate probes
+ * sent per period */
+#define HEALTH_ADMIT_WINDOW 200
+/* Max idle hosts probed per period, taken in turn */
+#define HEALTH_IDLE_PROBES 100
+#define SMALL_PROBE 8
+
+static struct health_data {
+	struct host *hosts;
+	struct host *tail;
+	uint64_t last_tick;
+	/* Added hosts not yet in list */
+	pthread_mutex_t pending_mutex;
+	struct host *pending;
+	int candidates;
+	/* Idle hosts to skip before probing, where the last tick stopped */
+	int idle_skip;
+} health = {
+	.pending_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void health_init(struct host *hosts)
+{
+	struct host *h;
+
+	health.hosts = hosts;
+	health.tail = NULL;
+	for (h = hosts; h; h = h->next) {
+		if (h->state == HOST_CANDIDATE)
+			health.candidates++;
+		health.tail = h;
+	}
+}
+
+void health_known_host(struct host *h)
+{
+	h->state = HOST_CANDIDATE;
+	h->probe_ok = HEALTH_READMIT_PROBES - 1;
+}
+
+void health_add_hosts(struct host *hosts)
+{
+	struct host *last;
+
+	if (!hosts)
+		return;
+	for (last = hosts; last->next; last = last->next)
+		;
+	pthread_mutex_lock(&health.pending_mutex);
+	last->next = health.pending;
+	health.pending = hosts;
+	pthread_mutex_unlock(&health.pending_mutex);
+}
+
+/* Move pending hosts to the end of the host list as candidates, as
+ * many as fit in the window. Only the network thread walks the list */
+static void take_pending()
+{
+	struct host *h;
+
+	pthread_mutex_lock(&health.pending_mutex);
+	while (health.pending && health.candidates < HEALTH_ADMIT_WINDOW) {
+		h = health.pending;
+		health.pending = h->next;
+		h->next = NULL;
+		h->state = HOST_CANDIDATE;
+		health.candidates++;
+		if (health.tail)
+			health.tail->next = h;
+		else
+			health.hosts = h;
+		health.tail = h;
+	}
+	pthread_mutex_unlock(&health.pending_mutex);
+}
+
+static void log_host(struct host *h, const char *msg)
+{
+	char name[NI_MAXHOST];
+
+	if (getnameinfo((struct sockaddr *) &h->sockaddr, h->sockaddr_len,
+		name, sizeof(name), NULL, 0, NI_NUMERICHOST))
+		snprintf(name, sizeof(name), "?");
+	printf("\nHost %s %s (loss %.0f%%, RTT %.02f ms)\n", name, msg,
+		h->loss * 100, h->srtt_us / 1000.0f);
+}
+
+/* Loss is estimated per period from chunks and probes sent and lost */
+static void update_loss(struct host *h)
+{
+	uint32_t sent = __atomic_load_n(&h->sent, __ATOMIC_RELAXED);
+	uint32_t lost = __atomic_load_n(&h->lost, __ATOMIC_RELAXED);
+	uint32_t dsent = sent - h->last_sent;
+	uint32_t dlost = lost - h->last_lost;
+
+	if (dsent) {
+		double sample = MIN(1.0, (double) dlost / dsent);
+		h->loss += (sample - h->loss) / 4;
+	}
+	h->last_sent = sent;
+	h->last_lost = lost;
+}
+
+static int degraded(struct host *h)
+{
+	uint32_t max_rtt;
+
+	if (h->loss > HEALTH_MAX_LOSS)
+		return 1;
+	max_rtt = MAX(h->min_rtt_us * HEALTH_MAX_RTT_FACTOR, HEALTH_MIN_RTT_US);
+	return h->min_rtt_us && h->srtt_us > max_rtt;
+}
+
+void health_tick(uint64_t now_us)
+{
+	struct host *h;
+	int healthy = 0;
+	int changed = 0;
+	int admitted = 0;
+	int probed = 0;
+	int idle_seen = 0;
+	int idle_probed = 0;
+
+	if (now_us - health.last_tick < HEALTH_PERIOD_US)
+		return;
+	health.last_tick = now_us;
+
+	take_pending();
+	for (h = health.hosts; h; h = h->next) {
+		/* Idle hosts get a probe too, to keep estimates fresh */
+		int idle = (h->sent == h->last_sent);
+		update_loss(h);
+		if (h->state == HOST_OK && !degraded(h))
+			healthy++;
+		/* Small probes, but the one that would admit it is
+		 * full sized, to check the host echoes whole chunks */
+		if (h->state == HOST_CANDIDATE) {
+			if (probed++ < HEALTH_ADMIT_WINDOW)
+				chunk_probe(h, h->probe_ok + 1 >= HEALTH_READMIT_PROBES ?
+					CHUNK_SIZE : SMALL_PROBE);
+		} else if (h->state == HOST_QUARANTINED) {
+			chunk_probe(h, SMALL_PROBE);
+		} else if (h->state == HOST_OK && idle &&
+			idle_seen++ >= health.idle_skip &&
+			idle_probed < HEALTH_IDLE_PROBES) {
+			chunk_probe(h, SMALL_PROBE);
+			idle_probed++;
+		}
+	}
+	/* Continue after the last one probed, or start over */
+	if (idle_probed < HEALTH_IDLE_PROBES)
+		health.idle_skip = 0;
+	else
+		health.idle_skip += idle_probed;
+
+	for (h = health.hosts; h; h = h->next) {
+		if (h->state == HOST_CANDIDATE) {
+			if (h->probe_ok >= HEALTH_READMIT_PROBES) {
+				h->state = HOST_OK;
+				health.candidates--;
+				changed = 1;
+				admitted++;
+			} else if (h->probe_lost >= HEALTH_REJECT_PROBES) {
+				/* Kept in list, readers might still see it */
+				h->state = HOST_REJECTED;
+				health.candidates--;
+			}
+		} else if (h->state == HOST_OK && degraded(h)) {
+			/* Always keep one host */
+			if (!healthy)
+				continue;
+			h->state = HOST_QUARANTINED;
+			h->probe_ok = 0;
+			h->probe_lost = 0;
+			changed = 1;
+			log_host(h, "quarantined");
+		} else if (h->state == HOST_QUARANTINED &&
+			h->probe_ok >= HEALTH_READMIT_PROBES && !degraded(h)) {
+			h->state = HOST_OK;
+			changed = 1;
+			log_host(h, "taken back");
+		}
+	}
+	if (admitted)
+		printf("\nAdded %d hosts\n", admitted);
+	if (changed)
+		sched_update();
+}
+
+void health_probe_reply(struct host *h)
+{
+	h->probe_ok++;
+}
+
+void health_probe_lost(struct host *h)
+{
+	h->probe_ok = 0;
+	h->probe_lost++;
+}
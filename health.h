@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_HEALTH_H_
+#define PINGFS_HEALTH_H_
+
+#include "host.h"
+
+#include <stdint.h>
+
+/* Start watching hosts */
+void health_init(struct host *hosts);
+
+/* Update loss estimates from live traffic, quarantine degrading
+ * hosts and probe quarantined and idle ones. Call from the
+ * network thread */
+void health_tick(uint64_t now_us);
+
+/* Mark a host known from an earlier run. It is not used until
+ * it answers one full sized probe. Call before health_init() */
+void health_known_host(struct host *h);
+
+/* Add hosts found while mounted. A few hundred at a time are
+ * probed, and used if they answer. Can be called from any thread */
+void health_add_hosts(struct host *hosts);
+
+/* Result of a probe sent by chunk_probe() */
+void health_probe_reply(struct host *h);
+void health_probe_lost(struct host *h);
+
+#endif /* PINGFS_HEALTH_H_ */
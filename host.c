@@ -16,14 +16,14 @@
 #include "host.h"
 #include "net.h"
 #include "chunk.h"
+#include "sched.h"
+#include "health.h"
+#include "timer.h"
+#include "metrics.h"
 
 #include <time.h>
 #include <assert.h>
 
-#ifndef CLOCK_MONOTONIC_RAW
-#define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
-#endif
-
 #include <sys/param.h>
 
 struct linked_gaicb {
@@ -31,16 +31,27 @@ struct linked_gaicb {
 	struct linked_gaicb *next;
 };
 
+/* Pings sent to each host when evaluating */
+#define EVAL_PINGS 5
+/* Max pings per second sent when evaluating */
+#define EVAL_PPS 20000
+/* Each host is told apart by a 32 bit tag of id and seqno: the id is
+ * the low 16 bits of its index, and the seqno holds the rest of the
+ * index above EVAL_ROUND_BITS bits counting the pings. This allows
+ * up to 2^29 hosts. EVAL_PINGS must fit in the round bits */
+#define EVAL_ROUND_BITS 3
+#define EVAL_MAX_HOSTS (1 << (32 - EVAL_ROUND_BITS))
+
 struct eval_host {
 	struct host *host;
-	struct timespec sendtime;
+	uint64_t sendtime;
 	uint16_t cur_seqno;
 	uint16_t id;
-	uint8_t *payload;
-	size_t payload_len;
-	int done;
+	/* Waiting for reply to cur_seqno */
+	int inflight;
 	int num_tx;
 	int num_rx;
+	uint32_t rtt_us[EVAL_PINGS];
 };
 
 static const struct addrinfo addr_request = {
@@ -137,121 +148,435 @@ struct host *host_create(struct gaicb *list[], int listlength)
 	return hosts;
 }
 
-static uint64_t latency_sum_us;
-static uint32_t latency_count;
+int host_read_file(const char *hfile, struct gaicb **list[])
+{
+	int h = 0;
+	FILE *file;
+
+	if (strcmp("-", hfile) == 0) {
+		file = stdin;
+	} else {
+		file = fopen(hfile, "r");
+		if (!file) {
+			perror("Failed to read file");
+			return h;
+		}
+	}
 
-static void diff_add(struct timespec *start, struct timespec *end)
+	h = host_make_resolvlist(file, list);
+	fclose(file);
+
+	return h;
+}
+
+int host_resolve(struct gaicb **list, int names, struct host **hosts)
 {
-	uint64_t us = (end->tv_sec - start->tv_sec) * 1000000;
-	us -= start->tv_nsec / 1000;
-	us += end->tv_nsec / 1000;
+	int ret;
+	int hostcount;
+	int i;
+
+	fprintf(stderr, "Resolving %d hostnames... ", names);
+	fflush(stderr);
 
-	latency_sum_us += us;
-	latency_count++;
+	ret = getaddrinfo_a(GAI_WAIT, list, names, NULL);
+	if (ret != 0) {
+		fprintf(stderr, "Resolving failed: %s\n", gai_strerror(ret));
+		return -1;
+	}
+
+	fprintf(stderr, "done.\n");
+
+	hostcount = 0;
+	for (i = 0; i < names; i++) {
+		ret = gai_error(list[i]);
+		if (ret) {
+			fprintf(stderr, "Skipping %s: %s\n", list[i]->ar_name, gai_strerror(ret));
+		} else {
+			struct addrinfo *result = list[i]->ar_result;
+			do {
+				hostcount++;
+				result = result->ai_next;
+			} while (result);
+		}
+	}
+	if (!hostcount) {
+		fprintf(stderr, "No hosts found!\n");
+		return -1;
+	}
+
+	*hosts = host_create(list, names);
+
+	if (*hosts == NULL) {
+		fprintf(stderr, "Failed creating list list, exiting\n");
+		return -1;
+	}
+
+	return hostcount;
 }
 
+/* Lower limit for timeouts. The network thread checks for
+ * late replies every 10 ms */
+#define HOST_MIN_RTO_US 20000
+/* Clock granularity, see RFC 6298 */
+#define HOST_RTT_G_US 1000
+
+static uint32_t max_rto_us = 1000000;
+
+void host_set_timeout(int seconds)
+{
+	max_rto_us = seconds * 1000000;
+}
+
+void host_rtt_sample(struct host *h, uint32_t rtt_us)
+{
+	uint32_t rto;
+
+	if (!rtt_us)
+		rtt_us = 1;
+	metrics_record(HIST_RTT, rtt_us);
+	if (!h->min_rtt_us || rtt_us < h->min_rtt_us)
+		h->min_rtt_us = rtt_us;
+	if (!h->srtt_us) {
+		h->srtt_us = rtt_us;
+		h->rttvar_us = rtt_us / 2;
+	} else {
+		uint32_t delta = MAX(h->srtt_us, rtt_us) - MIN(h->srtt_us, rtt_us);
+		/* beta = 1/4, alpha = 1/8 */
+		h->rttvar_us = h->rttvar_us - h->rttvar_us / 4 + delta / 4;
+		h->srtt_us = h->srtt_us - h->srtt_us / 8 + rtt_us / 8;
+	}
+	rto = h->srtt_us + MAX(HOST_RTT_G_US, 4 * h->rttvar_us);
+	rto = MAX(rto, HOST_MIN_RTO_US);
+	rto = MIN(rto, max_rto_us);
+	__atomic_store_n(&h->rto_us, rto, __ATOMIC_RELAXED);
+}
+
+uint32_t host_rto_us(struct host *h)
+{
+	uint32_t rto;
+
+	if (!h)
+		return max_rto_us;
+	rto = __atomic_load_n(&h->rto_us, __ATOMIC_RELAXED);
+	if (!rto)
+		return max_rto_us;
+	return rto;
+}
+
+/* Chunks a host starts with, and the least it is cut to */
+#define HOST_INIT_CWND 16
+#define HOST_MIN_CWND 2
+
+static void cc_init(struct host *h)
+{
+	if (h->cwnd)
+		return;
+	h->cwnd = HOST_INIT_CWND;
+	h->ssthresh = 1e9;
+	__atomic_store_n(&h->cwnd_chunks, HOST_INIT_CWND, __ATOMIC_RELAXED);
+}
+
+void host_cc_reply(struct host *h)
+{
+	cc_init(h);
+	/* Only grow when the window is used */
+	if (h->chunks + 1 < h->cwnd)
+		return;
+	if (h->cwnd < h->ssthresh)
+		h->cwnd += 1;
+	else
+		h->cwnd += 1 / h->cwnd;
+	__atomic_store_n(&h->cwnd_chunks, (uint32_t) h->cwnd, __ATOMIC_RELAXED);
+}
+
+void host_cc_loss(struct host *h, uint64_t now_us)
+{
+	cc_init(h);
+	/* Cut at most once per round trip */
+	if (now_us - h->cwnd_cut_us < host_rto_us(h))
+		return;
+	h->cwnd_cut_us = now_us;
+	h->ssthresh = MAX(h->cwnd / 2, HOST_MIN_CWND);
+	h->cwnd = h->ssthresh;
+	__atomic_store_n(&h->cwnd_chunks, (uint32_t) h->cwnd, __ATOMIC_RELAXED);
+}
+
+int host_has_room(struct host *h)
+{
+	uint32_t cwnd = __atomic_load_n(&h->cwnd_chunks, __ATOMIC_RELAXED);
+
+	if (!cwnd)
+		cwnd = HOST_INIT_CWND;
+	return __atomic_load_n(&h->chunks, __ATOMIC_RELAXED) < cwnd;
+}
+
+struct eval_ping {
+	int host;
+	uint16_t seqno;
+};
+
 struct evaldata {
 	struct eval_host *hosts;
 	int count;
+	uint8_t *payload;
+	size_t payload_len;
+	/* Open addressing hash of host index + 1 by address and tag */
+	int *hash;
+	uint32_t hash_mask;
+	/* Hosts waiting to send, a host is in it at most once */
+	int *ready;
+	int ready_head;
+	int ready_len;
+	/* Pings in send order, each ping is added once */
+	struct eval_ping *sent;
+	int sent_head;
+	int sent_len;
+	int done;
 };
 
+static uint32_t eval_tag(uint16_t id, uint16_t seqno)
+{
+	return id | (uint32_t) (seqno >> EVAL_ROUND_BITS) << 16;
+}
+
+static uint32_t eval_hash(struct sockaddr_storage *addr, size_t addrlen, uint32_t tag)
+{
+	const uint8_t *p = (const uint8_t *) addr;
+	uint32_t h = 2166136261u ^ tag;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < addrlen; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void eval_hash_add(struct evaldata *eval, int idx)
+{
+	struct eval_host *eh = &eval->hosts[idx];
+	uint32_t h = eval_hash(&eh->host->sockaddr, eh->host->sockaddr_len,
+		eval_tag(eh->id, eh->cur_seqno));
+
+	while (eval->hash[h & eval->hash_mask])
+		h++;
+	eval->hash[h & eval->hash_mask] = idx + 1;
+}
+
+static struct eval_host *eval_hash_find(struct evaldata *eval,
+	struct sockaddr_storage *addr, size_t addrlen, uint16_t id, uint16_t seqno)
+{
+	uint32_t tag = eval_tag(id, seqno);
+	uint32_t h = eval_hash(addr, addrlen, tag);
+	int idx;
+
+	while ((idx = eval->hash[h & eval->hash_mask])) {
+		struct eval_host *eh = &eval->hosts[idx - 1];
+		if (eval_tag(eh->id, eh->cur_seqno) == tag && addrlen == eh->host->sockaddr_len &&
+			memcmp(addr, &eh->host->sockaddr, addrlen) == 0)
+			return eh;
+		h++;
+	}
+	return NULL;
+}
+
+static void ready_push(struct evaldata *eval, int idx)
+{
+	eval->ready[(eval->ready_head + eval->ready_len) % eval->count] = idx;
+	eval->ready_len++;
+}
+
+static int ready_pop(struct evaldata *eval)
+{
+	int idx = eval->ready[eval->ready_head];
+	eval->ready_head = (eval->ready_head + 1) % eval->count;
+	eval->ready_len--;
+	return idx;
+}
+
+/* Host is done with a ping, send next or finish */
+static void eval_next(struct evaldata *eval, struct eval_host *eh)
+{
+	eh->inflight = 0;
+	eh->cur_seqno++;
+	if (eh->num_tx < EVAL_PINGS)
+		ready_push(eval, eh - eval->hosts);
+	else
+		eval->done++;
+}
+
 static void eval_reply(void *userdata, struct sockaddr_storage *addr,
-	size_t addrlen, uint16_t id, uint16_t seqno, uint8_t **data, size_t len)
+	size_t addrlen, uint16_t id, uint16_t seqno, uint16_t csum, uint8_t **data, size_t len)
 {
-	int i;
 	struct evaldata *eval = (struct evaldata *) userdata;
-	struct timespec recvtime;
-	clock_gettime(CLOCK_MONOTONIC_RAW, &recvtime);
-	for (i = 0; i < eval->count; i++) {
-		struct eval_host *eh = &eval->hosts[i];
-		if (addrlen == eh->host->sockaddr_len &&
-			memcmp(addr, &eh->host->sockaddr, addrlen) == 0 &&
-			eh->payload_len == len &&
-			memcmp(*data, eh->payload, eh->payload_len) == 0 &&
-			eh->id == id &&
-			eh->cur_seqno == seqno) {
-
-			/* Store accepted reply */
-			eh->num_rx++;
-			eh->done = 1;
-			net_inc_rx(eh->payload_len);
-			/* Use new seqno for next packet */
-			eh->cur_seqno++;
-			diff_add(&eh->sendtime, &recvtime);
-			break;
+	struct eval_host *eh;
+	uint64_t rtt;
+
+	eh = eval_hash_find(eval, addr, addrlen, id, seqno);
+	if (!eh || !eh->inflight || eh->cur_seqno != seqno ||
+		eval->payload_len != len ||
+		memcmp(*data, eval->payload, eval->payload_len) != 0)
+		return;
+
+	/* Store accepted reply */
+	rtt = timer_now_us() - eh->sendtime;
+	eh->rtt_us[eh->num_rx++] = rtt;
+	net_inc_rx(eval->payload_len);
+	/* Seed estimates for the host */
+	host_rtt_sample(eh->host, rtt);
+	eval_next(eval, eh);
+}
+
+/* Time out pings in send order, they all have the same timeout */
+static void eval_expire(struct evaldata *eval, uint64_t now, uint64_t timeout_us)
+{
+	while (eval->sent_len) {
+		struct eval_ping *ping = &eval->sent[eval->sent_head];
+		struct eval_host *eh = &eval->hosts[ping->host];
+
+		/* Skip pings already answered */
+		if (eh->inflight && eh->cur_seqno == ping->seqno) {
+			if (now - eh->sendtime < timeout_us)
+				break;
+			eval_next(eval, eh);
 		}
+		eval->sent_head++;
+		eval->sent_len--;
 	}
 }
 
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Percentile p (0-100) of sorted values */
+static uint32_t percentile(uint32_t *sorted, int n, int p)
+{
+	if (!n)
+		return 0;
+	return sorted[MIN(n - 1, n * p / 100)];
+}
+
+static void eval_free(struct evaldata *eval)
+{
+	free(eval->hosts);
+	free(eval->hash);
+	free(eval->ready);
+	free(eval->sent);
+}
+
+/* Ping each host EVAL_PINGS times, one ping at a time per host but with
+ * many hosts in flight. Sending is paced to EVAL_PPS. */
 int host_evaluate(struct host **hosts, int length, int timeout)
 {
 	int i;
-	int addr;
 	int good_hosts;
+	int progress;
 	struct host *host;
 	struct host *prev;
 	struct evaldata evaldata;
 	uint8_t eval_payload[CHUNK_SIZE];
-
+	uint64_t timeout_us = timeout * 1000000ULL;
+	uint64_t last_send;
+	double tokens = 0;
+	uint32_t *medians;
+	uint32_t *all_rtts;
+	int num_rtts = 0;
+	uint64_t total_tx = 0;
+	uint64_t total_rx = 0;
+
+	if (length > EVAL_MAX_HOSTS) {
+		fprintf(stderr, "Too many hosts to evaluate\n");
+		return 0;
+	}
+	memset(&evaldata, 0, sizeof(evaldata));
 	evaldata.count = length;
+	evaldata.hash_mask = 1;
+	while (evaldata.hash_mask < 2 * length)
+		evaldata.hash_mask <<= 1;
 	evaldata.hosts = calloc(length, sizeof(struct eval_host));
-	if (!evaldata.hosts)
+	evaldata.hash = calloc(evaldata.hash_mask, sizeof(int));
+	evaldata.ready = calloc(length, sizeof(int));
+	evaldata.sent = calloc(length * EVAL_PINGS, sizeof(struct eval_ping));
+	evaldata.hash_mask--;
+	if (!evaldata.hosts || !evaldata.hash || !evaldata.ready || !evaldata.sent) {
+		eval_free(&evaldata);
 		return 0;
+	}
 
 	for (i = 0; i < sizeof(eval_payload); i++) {
 		eval_payload[i] = i & 0xff;
 	}
+	evaldata.payload = eval_payload;
+	evaldata.payload_len = sizeof(eval_payload);
 
-	addr = 0;
 	host = *hosts;
 	for (i = 0; i < length; i++) {
-		evaldata.hosts[addr].host = host;
-		evaldata.hosts[addr].id = addr;
-		evaldata.hosts[addr].cur_seqno = addr * 2;
-		evaldata.hosts[addr].payload = eval_payload;
-		evaldata.hosts[addr].payload_len = sizeof(eval_payload);
-		addr++;
+		evaldata.hosts[i].host = host;
+		evaldata.hosts[i].id = i & 0xffff;
+		evaldata.hosts[i].cur_seqno = (i >> 16) << EVAL_ROUND_BITS;
+		eval_hash_add(&evaldata, i);
+		evaldata.ready[i] = i;
 		host = host->next;
 	}
+	evaldata.ready_len = length;
 
 	printf("Evaluating %d hosts (timeout=%ds).", length, timeout);
-	for (i = 0; i < 5; i++) {
-		int h;
+	fflush(stdout);
+	progress = 0;
+	last_send = timer_now_us();
+	while (evaldata.done < length) {
 		struct timeval tv;
-
-		printf(".");
-		fflush(stdout);
-		for (h = 0; h < length; h++) {
-			struct eval_host *eh = &evaldata.hosts[h];
-			clock_gettime(CLOCK_MONOTONIC_RAW, &eh->sendtime);
-			eh->done = 0;
+		uint64_t now = timer_now_us();
+
+		/* Send as many pings as the rate allows */
+		tokens += (double) (now - last_send) * EVAL_PPS / 1000000;
+		tokens = MIN(tokens, EVAL_PPS / 100);
+		last_send = now;
+		while (tokens >= 1 && evaldata.ready_len) {
+			struct eval_host *eh;
+			i = ready_pop(&evaldata);
+			eh = &evaldata.hosts[i];
+			eh->sendtime = now;
+			eh->inflight = 1;
 			eh->num_tx++;
 			net_send(eh->host, eh->id, eh->cur_seqno,
-				eh->payload, eh->payload_len);
+				evaldata.payload, evaldata.payload_len);
+			evaldata.sent[evaldata.sent_head + evaldata.sent_len].host = i;
+			evaldata.sent[evaldata.sent_head + evaldata.sent_len].seqno = eh->cur_seqno;
+			evaldata.sent_len++;
+			tokens--;
 		}
 
-		tv.tv_sec = timeout;
-		tv.tv_usec = 0;
-		for (;;) {
-			int alldone = 1;
-			int res;
-
-			for (h = 0; h < length; h++) {
-				alldone &= evaldata.hosts[h].done;
-			}
-			if (alldone) /* All hosts have replied */
-				break;
+		tv.tv_sec = 0;
+		tv.tv_usec = 1000;
+		net_recv(&tv, eval_reply, &evaldata);
+		eval_expire(&evaldata, timer_now_us(), timeout_us);
 
-			res = net_recv(&tv, eval_reply, &evaldata);
-			if (!res) /* Timeout, give up */
-				break;
+		while (progress < evaldata.done * 10 / length) {
+			printf(".");
+			fflush(stdout);
+			progress++;
 		}
 	}
 	printf(" done.\n");
 
+	medians = calloc(length, sizeof(uint32_t));
+	all_rtts = calloc(length * EVAL_PINGS, sizeof(uint32_t));
 	good_hosts = 0;
 	for (i = 0; i < length; i++) {
 		struct eval_host *eh = &evaldata.hosts[i];
+
+		total_tx += eh->num_tx;
+		total_rx += eh->num_rx;
+		if (eh->num_rx && all_rtts) {
+			memcpy(&all_rtts[num_rtts], eh->rtt_us, eh->num_rx * sizeof(uint32_t));
+			num_rtts += eh->num_rx;
+		}
 		/* Filter out hosts with below 100% result */
 		if (eh->num_tx == 0 ||
 			eh->num_tx != eh->num_rx) {
@@ -259,6 +584,9 @@ int host_evaluate(struct host **hosts, int length, int timeout)
 			/* Mark host for deletion */
 			eh->host->sockaddr_len = 0;
 		} else {
+			qsort(eh->rtt_us, eh->num_rx, sizeof(uint32_t), cmp_u32);
+			if (medians)
+				medians[good_hosts] = percentile(eh->rtt_us, eh->num_rx, 50);
 			good_hosts++;
 		}
 	}
@@ -281,34 +609,36 @@ int host_evaluate(struct host **hosts, int length, int timeout)
 		host = next;
 	}
 
-	free(evaldata.hosts);
+	eval_free(&evaldata);
 	printf("%d of %d hosts responded correctly to all pings", good_hosts, length);
-	if (good_hosts) {
-		printf(" (average RTT %.02f ms)",
-			latency_sum_us / ( latency_count * 1000.0f));
+	if (total_tx) {
+		printf(", %.01f%% of pings lost", 100.0 * (total_tx - total_rx) / total_tx);
 	}
 	printf("\n");
+	if (good_hosts && medians && all_rtts) {
+		qsort(medians, good_hosts, sizeof(uint32_t), cmp_u32);
+		qsort(all_rtts, num_rtts, sizeof(uint32_t), cmp_u32);
+		printf("RTT of all pings: p50 %.02f ms, p90 %.02f ms, p99 %.02f ms\n",
+			percentile(all_rtts, num_rtts, 50) / 1000.0f,
+			percentile(all_rtts, num_rtts, 90) / 1000.0f,
+			percentile(all_rtts, num_rtts, 99) / 1000.0f);
+		printf("Median RTT per good host: p10 %.02f ms, p50 %.02f ms, p90 %.02f ms\n",
+			percentile(medians, good_hosts, 10) / 1000.0f,
+			percentile(medians, good_hosts, 50) / 1000.0f,
+			percentile(medians, good_hosts, 90) / 1000.0f);
+	}
+	free(medians);
+	free(all_rtts);
 	return good_hosts;
 }
 
-static struct host *hosts_start;
-static struct host *hosts_cur;
-
 void host_use(struct host* hosts)
 {
-	hosts_start = hosts;
+	health_init(hosts);
+	sched_init(hosts);
 }
 
-/* Return next host.
- * Emulate a cyclic list of hosts */
 struct host *host_get_next()
 {
-	struct host *h;
-	assert(hosts_start);
-	if (!hosts_cur)
-		hosts_cur = hosts_start;
-	h = hosts_cur;
-	hosts_cur = hosts_cur->next;
-	return h;
+	return sched_pick();
 }
-
@@ -21,11 +21,48 @@
 #include <string.h>
 #include <netdb.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+enum host_state {
+	HOST_OK,
+	/* Not given new chunks, and its chunks are moved away */
+	HOST_QUARANTINED,
+	/* Added while mounted, probed until admitted or rejected */
+	HOST_CANDIDATE,
+	HOST_REJECTED,
+};
 
 struct host {
 	struct host *next;
 	struct sockaddr_storage sockaddr;
 	socklen_t sockaddr_len;
+	/* Round trip time estimates (RFC 6298), in microseconds.
+	 * Only updated by the network thread */
+	uint32_t srtt_us;
+	uint32_t rttvar_us;
+	uint32_t rto_us;
+	uint32_t min_rtt_us;
+	/* Congestion window, max chunks to keep on host. Only
+	 * cwnd_chunks is read outside the network thread */
+	double cwnd;
+	double ssthresh;
+	uint64_t cwnd_cut_us;
+	uint32_t cwnd_chunks;
+	/* Chunks stored on host, and sent to and lost by it */
+	uint32_t chunks;
+	uint32_t sent;
+	uint32_t lost;
+	/* Loss rate estimate, and counters when it was last updated */
+	double loss;
+	uint32_t last_sent;
+	uint32_t last_lost;
+	enum host_state state;
+	/* Probe replies in a row, and probes lost, since
+	 * quarantined or added */
+	uint32_t probe_ok;
+	uint32_t probe_lost;
+	/* Model state when the network is simulated */
+	struct sim_host *sim;
 };
 
 int host_make_resolvlist(FILE *hostfile, struct gaicb **list[]);
@@ -33,10 +70,35 @@ void host_free_resolvlist(struct gaicb *list[], int length);
 
 struct host *host_create(struct gaicb *list[], int listlength);
 
+/* Read hostnames from a file, or stdin if "-". Returns the count */
+int host_read_file(const char *hfile, struct gaicb **list[]);
+/* Resolve hostnames and make hosts of all addresses.
+ * Returns the count of addresses, or -1 */
+int host_resolve(struct gaicb **list, int names, struct host **hosts);
+
+/* Ping hosts and remove the ones not answering all pings. Takes
+ * up to 2^29 hosts. Returns the count left */
 int host_evaluate(struct host **hosts, int length, int timeout);
 
 void host_use(struct host* hosts);
 
+/* Get host for a new chunk, from the placement scheduler.
+ * Returns NULL if all hosts are full */
 struct host *host_get_next();
 
+/* Upper limit for retransmission timeouts (seconds), used until
+ * a host has RTT samples */
+void host_set_timeout(int seconds);
+/* Update estimates with a measured round trip time */
+void host_rtt_sample(struct host *h, uint32_t rtt_us);
+/* Time to wait for a reply from host before it is late */
+uint32_t host_rto_us(struct host *h);
+
+/* Congestion control, grow window on replies and halve it
+ * when chunks are late */
+void host_cc_reply(struct host *h);
+void host_cc_loss(struct host *h, uint64_t now_us);
+/* Host can take another chunk */
+int host_has_room(struct host *h);
+
 #endif /* PINGFS_HOST_H_ */
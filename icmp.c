@@ -15,7 +15,9 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/uio.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
 #include <arpa/inet.h>
@@ -27,6 +29,7 @@ struct icmp_rule {
 	int reply_type;
 	int use_checksum;
 	int strip_iphdr;
+	int id_in_payload;
 };
 
 static const struct icmp_rule icmpv4 = {
@@ -34,28 +37,134 @@ static const struct icmp_rule icmpv4 = {
 	.reply_type = ICMP_ECHOREPLY,
 	.use_checksum = 1,
 	.strip_iphdr = 1,
+	.id_in_payload = 0,
 };
 static const struct icmp_rule icmpv6 = {
 	.request_type = ICMP6_ECHO_REQUEST,
 	.reply_type = ICMP6_ECHO_REPLY,
 	.use_checksum = 0,
 	.strip_iphdr = 0,
+	.id_in_payload = 0,
 };
+/* Kernel does checksums and gives no IP header on datagram sockets */
+static const struct icmp_rule icmpv4_dgram = {
+	.request_type = ICMP_ECHO,
+	.reply_type = ICMP_ECHOREPLY,
+	.use_checksum = 0,
+	.strip_iphdr = 0,
+	.id_in_payload = 1,
+};
+static const struct icmp_rule icmpv6_dgram = {
+	.request_type = ICMP6_ECHO_REQUEST,
+	.reply_type = ICMP6_ECHO_REPLY,
+	.use_checksum = 0,
+	.strip_iphdr = 0,
+	.id_in_payload = 1,
+};
+
+/* Packet sockets give the full IP packet, and nothing is verified */
+static const struct icmp_rule icmpv4_packet = {
+	.request_type = ICMP_ECHO,
+	.reply_type = ICMP_ECHOREPLY,
+	.use_checksum = 1,
+	.strip_iphdr = 1,
+	.id_in_payload = 0,
+};
+static const struct icmp_rule icmpv6_packet = {
+	.request_type = ICMP6_ECHO_REQUEST,
+	.reply_type = ICMP6_ECHO_REPLY,
+	.use_checksum = 1,
+	.strip_iphdr = 1,
+	.id_in_payload = 0,
+};
+
+static const struct icmp_rule *get_rule(struct icmp_packet *pkt)
+{
+	if (pkt->transport == ICMP_PACKET)
+		return (ICMP_ADDRFAMILY(pkt) == AF_INET) ? &icmpv4_packet : &icmpv6_packet;
+	if (pkt->transport == ICMP_DGRAM)
+		return (ICMP_ADDRFAMILY(pkt) == AF_INET) ? &icmpv4_dgram : &icmpv6_dgram;
+	return (ICMP_ADDRFAMILY(pkt) == AF_INET) ? &icmpv4 : &icmpv6;
+}
 
-#define GET_RULE(pkt) ((ICMP_ADDRFAMILY(pkt) == AF_INET) ? &icmpv4 : &icmpv6 )
+#define GET_RULE(pkt) get_rule(pkt)
 
-static uint16_t checksum(uint8_t *data, uint32_t len)
+/* One's complement sum of data (RFC 1071), kept in native byte order.
+ * 32 bit words are added into a 64 bit accumulator, so carries do not
+ * need handling until the end. Works on any alignment, and the plain
+ * word loop is vectorised by the compiler. Callers summing several
+ * buffers must only split them at even offsets. */
+static uint64_t checksum_add(uint64_t sum, const uint8_t *data, uint32_t len)
 {
-	uint32_t csum = 0;
-	uint32_t i;
-	for (i = 0; i < len; i += 2) {
-		uint16_t c = data[i] << 8;
-		if (i + 1 < len) c |= data[i + 1];
-		csum += c;
+	uint32_t w;
+	uint16_t s;
+
+	while (len >= 16) {
+		uint32_t words[4];
+		memcpy(words, data, sizeof(words));
+		sum += words[0];
+		sum += words[1];
+		sum += words[2];
+		sum += words[3];
+		data += 16;
+		len -= 16;
+	}
+	while (len >= 4) {
+		memcpy(&w, data, sizeof(w));
+		sum += w;
+		data += 4;
+		len -= 4;
 	}
-	csum = (csum >> 16) + (csum & 0xffff);
-	csum += (csum >> 16);
-	return (uint16_t)(~csum);
+	if (len >= 2) {
+		memcpy(&s, data, sizeof(s));
+		sum += s;
+		data += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* Odd byte is padded with a zero byte after it */
+		uint8_t last[2] = { data[0], 0 };
+		memcpy(&s, last, sizeof(s));
+		sum += s;
+	}
+	return sum;
+}
+
+/* Fold sum into a 16 bit checksum, returned in host byte order */
+static uint16_t checksum_fold(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return ntohs((uint16_t)(~sum));
+}
+
+uint16_t icmp_checksum(const uint8_t *data, uint32_t len)
+{
+	return checksum_fold(checksum_add(0, data, len));
+}
+
+/* Update checksum when one 16 bit word changes, RFC 1624 eqn. 3 */
+static uint16_t checksum_update(uint16_t csum, uint16_t old, uint16_t new)
+{
+	uint32_t sum;
+
+	sum = (uint16_t) ~csum;
+	sum += (uint16_t) ~old;
+	sum += new;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return (uint16_t)(~sum);
+}
+
+uint16_t icmp_request_checksum(uint16_t reply_csum, uint16_t reply_seqno, uint16_t seqno)
+{
+	uint16_t csum;
+
+	/* Type and code share the first word */
+	csum = checksum_update(reply_csum, icmpv4.reply_type << 8, icmpv4.request_type << 8);
+	return checksum_update(csum, reply_seqno, seqno);
 }
 
 static uint16_t read16(uint8_t *data)
@@ -69,65 +178,107 @@ static void write16(uint8_t *data, uint16_t s)
 	data[1] = s & 0xFF;
 }
 
-static uint8_t *icmp_encode(struct icmp_packet *pkt, int *len)
+int icmp_encode(struct icmp_packet *pkt, uint8_t *hdr)
 {
 	struct icmp_rule const *rule = GET_RULE(pkt);
-	uint8_t *data;
-	int pktlen;
-
-	pktlen = ICMP_HDRLEN + pkt->payload_len;
-	data = calloc(1, pktlen);
-	if (!data)
-		return NULL;
+	int hdrlen = ICMP_HDRLEN;
 
+	memset(hdr, 0, ICMP_MAX_HDRLEN);
 	if (pkt->type == ICMP_REQUEST) {
-		data[0] = rule->request_type;
+		hdr[0] = rule->request_type;
 	} else {
-		data[0] = rule->reply_type;
+		hdr[0] = rule->reply_type;
 	}
 
-	write16(&data[4], pkt->id);
-	write16(&data[6], pkt->seqno);
-	if (pkt->payload_len)
-		memcpy(&data[8], pkt->payload, pkt->payload_len);
+	write16(&hdr[4], pkt->id);
+	write16(&hdr[6], pkt->seqno);
+	if (rule->id_in_payload) {
+		write16(&hdr[ICMP_HDRLEN], pkt->id);
+		hdrlen += ICMP_ID_TAGLEN;
+	}
 
 	if (rule->use_checksum) {
-		write16(&data[2], checksum(data, pktlen));
+		if (pkt->checksum) {
+			write16(&hdr[2], pkt->checksum);
+		} else {
+			/* Header length is even, so the payload can be summed separately */
+			uint64_t sum = checksum_add(0, hdr, hdrlen);
+			sum = checksum_add(sum, pkt->payload, pkt->payload_len);
+			write16(&hdr[2], checksum_fold(sum));
+		}
 	}
-
-	*len = pktlen;
-	return data;
+	return hdrlen;
 }
 
 int icmp_send(int socket, struct icmp_packet *pkt)
 {
-	int len;
-	uint8_t *icmpdata;
+	uint8_t hdr[ICMP_MAX_HDRLEN];
+	struct iovec iov[2];
+	struct msghdr msg;
 
-	icmpdata = icmp_encode(pkt, &len);
-	if (!icmpdata)
-		return 0;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = icmp_encode(pkt, hdr);
+	iov[1].iov_base = pkt->payload;
+	iov[1].iov_len = pkt->payload_len;
 
-	len = sendto(socket, icmpdata, len, 0, (struct sockaddr *) &pkt->peer, pkt->peer_len);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &pkt->peer;
+	msg.msg_namelen = pkt->peer_len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = pkt->payload_len ? 2 : 1;
 
-	free(icmpdata);
-	return len;
+	return sendmsg(socket, &msg, 0);
+}
+
+#define IP6_HDRLEN 40
+
+/* Sum of the IPv6 pseudo header (RFC 2460 section 8.1) */
+static uint64_t ip6_pseudo_sum(uint8_t *ip6hdr, uint32_t icmplen)
+{
+	uint8_t tail[8];
+	uint64_t sum;
+
+	/* Source and destination addresses */
+	sum = checksum_add(0, &ip6hdr[8], 32);
+	tail[0] = icmplen >> 24;
+	tail[1] = icmplen >> 16;
+	tail[2] = icmplen >> 8;
+	tail[3] = icmplen;
+	tail[4] = tail[5] = tail[6] = 0;
+	tail[7] = IPPROTO_ICMPV6;
+	return checksum_add(sum, tail, sizeof(tail));
 }
 
 int icmp_parse(struct icmp_packet *pkt, uint8_t *data, int len)
 {
 	struct icmp_rule const *rule = GET_RULE(pkt);
+	uint64_t sum = 0;
 	if (rule->strip_iphdr) {
 		int hdrlen;
+		int totlen;
 		if (len == 0) return -3;
-		hdrlen = (data[0] & 0x0f) << 2;
-		if (len < hdrlen) return -4;
+		if (ICMP_ADDRFAMILY(pkt) == AF_INET) {
+			if (len < 4) return -4;
+			hdrlen = (data[0] & 0x0f) << 2;
+			totlen = read16(&data[2]);
+		} else {
+			hdrlen = IP6_HDRLEN;
+			if (len < hdrlen) return -4;
+			/* Extension headers are not expected on echo replies */
+			if (data[6] != IPPROTO_ICMPV6) return -4;
+			totlen = hdrlen + read16(&data[4]);
+		}
+		if (len < hdrlen || totlen < hdrlen) return -4;
+		/* Ignore link layer padding after the IP packet */
+		if (totlen < len) len = totlen;
+		if (ICMP_ADDRFAMILY(pkt) == AF_INET6)
+			sum = ip6_pseudo_sum(data, len - hdrlen);
 		data += hdrlen;
 		len -= hdrlen;
 	}
 	if (len < ICMP_HDRLEN) return -1;
 	if (rule->use_checksum) {
-		if (checksum(data, len) != 0) return -2;
+		if (checksum_fold(checksum_add(sum, data, len)) != 0) return ICMP_BAD_CHECKSUM;
 	}
 	if (rule->request_type == data[0]) {
 		pkt->type = ICMP_REQUEST;
@@ -136,12 +287,19 @@ int icmp_parse(struct icmp_packet *pkt, uint8_t *data, int len)
 	} else {
 		return -5;
 	}
+	pkt->checksum = read16(&data[2]);
 	pkt->id = read16(&data[4]);
 	pkt->seqno = read16(&data[6]);
 	pkt->payload_len = len - ICMP_HDRLEN;
+	if (rule->id_in_payload) {
+		/* Kernel has replaced the id in the header */
+		if (pkt->payload_len < ICMP_ID_TAGLEN) return -6;
+		pkt->id = read16(&data[ICMP_HDRLEN]);
+		data += ICMP_ID_TAGLEN;
+		pkt->payload_len -= ICMP_ID_TAGLEN;
+	}
 	if (pkt->payload_len) {
-		pkt->payload = malloc(pkt->payload_len);
-		memcpy(pkt->payload, &data[ICMP_HDRLEN], pkt->payload_len);
+		pkt->payload = &data[ICMP_HDRLEN];
 	} else {
 		pkt->payload = NULL;
 	}
@@ -24,24 +24,59 @@
 #define ICMP_ADDRFAMILY(pkt) ((pkt)->peer.ss_family)
 
 #define ICMP_HDRLEN 8
+/* Datagram sockets carry our id first in the payload */
+#define ICMP_ID_TAGLEN 2
+#define ICMP_MAX_HDRLEN (ICMP_HDRLEN + ICMP_ID_TAGLEN)
 
 enum icmp_type {
 	ICMP_REQUEST,
 	ICMP_REPLY,
 };
 
+enum icmp_transport {
+	/* Raw socket, we handle the full ICMP packet */
+	ICMP_RAW,
+	/* Linux ICMP datagram (ping) socket. The kernel owns the id
+	 * field, so our id is sent as a tag at the start of the payload */
+	ICMP_DGRAM,
+	/* Packet socket receiving full IP packets. Peer
+	 * address must be filled in before parsing */
+	ICMP_PACKET,
+};
+
 struct icmp_packet {
 	struct sockaddr_storage peer;
 	socklen_t peer_len;
+	enum icmp_transport transport;
 	enum icmp_type type;
 	uint16_t id;
 	uint16_t seqno;
+	/* Checksum as received. When sending, a nonzero value
+	 * is used as is instead of calculating it (IPv4 only) */
+	uint16_t checksum;
 	uint8_t *payload;
 	uint32_t payload_len;
 };
 
+#define ICMP_BAD_CHECKSUM -2
+
+/* Parse packet in data. On success the payload of pkt points
+ * into data, so data must stay around while pkt is used.
+ * Returns 0 on success, ICMP_BAD_CHECKSUM or another negative value */
 extern int icmp_parse(struct icmp_packet *pkt, uint8_t *data, int len);
 extern void icmp_dump(struct icmp_packet *pkt);
+/* Fill in the ICMP header for pkt in hdr (ICMP_MAX_HDRLEN bytes) and
+ * return its length. The payload is only read to calculate the checksum,
+ * it should be sent right after the header. */
+extern int icmp_encode(struct icmp_packet *pkt, uint8_t *hdr);
+/* Send pkt, header and payload are sent without copying them together.
+ * Returns number of bytes sent or -1 on error. */
 extern int icmp_send(int socket, struct icmp_packet *pkt);
+/* Internet checksum (RFC 1071) of data, in host byte order */
+extern uint16_t icmp_checksum(const uint8_t *data, uint32_t len);
+/* Get checksum for an IPv4 echo request with seqno, when it has the same
+ * id and payload as an echo reply with reply_csum and reply_seqno.
+ * Saves summing the whole payload again when resending it. */
+extern uint16_t icmp_request_checksum(uint16_t reply_csum, uint16_t reply_seqno, uint16_t seqno);
 
 #endif /* PINGFS_ICMP_H_ */
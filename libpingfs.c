@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "libpingfs.h"
+#include "fs.h"
+#include "setup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct handle {
+	/* With leading '/', NULL when free */
+	char *name;
+};
+
+static struct {
+	/* Held through start and stop */
+	pthread_mutex_t start_lock;
+	pthread_mutex_t mutex;
+	int started;
+	struct handle *handles;
+	int nhandles;
+
+	/* Async requests */
+	pthread_t workers[PINGFS_WORKERS];
+	int nworkers;
+	pthread_cond_t submitted;
+	pthread_cond_t completed;
+	struct pingfs_req *queue;
+	struct pingfs_req **queue_tail;
+	struct pingfs_req *done;
+	struct pingfs_req **done_tail;
+	/* Submitted and not yet reaped */
+	int inflight;
+	int stop;
+} lib = {
+	.start_lock = PTHREAD_MUTEX_INITIALIZER,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.submitted = PTHREAD_COND_INITIALIZER,
+	.completed = PTHREAD_COND_INITIALIZER,
+};
+
+static char *fs_name(const char *name)
+{
+	char *path;
+
+	if (name[0] == '/')
+		name++;
+	if (!name[0] || strchr(name, '/'))
+		return NULL;
+	path = malloc(strlen(name) + 2);
+	if (path) {
+		path[0] = '/';
+		strcpy(&path[1], name);
+	}
+	return path;
+}
+
+/* Copy of the name of an open handle, or NULL */
+static char *handle_name(int fd)
+{
+	char *name = NULL;
+
+	pthread_mutex_lock(&lib.mutex);
+	if (fd >= 0 && fd < lib.nhandles && lib.handles[fd].name)
+		name = strdup(lib.handles[fd].name);
+	pthread_mutex_unlock(&lib.mutex);
+	return name;
+}
+
+static int add_handle(char *name)
+{
+	int fd;
+
+	pthread_mutex_lock(&lib.mutex);
+	for (fd = 0; fd < lib.nhandles; fd++) {
+		if (!lib.handles[fd].name)
+			break;
+	}
+	if (fd == lib.nhandles) {
+		int n = lib.nhandles ? lib.nhandles * 2 : 16;
+		struct handle *h = realloc(lib.handles, n * sizeof(*h));
+		if (!h) {
+			pthread_mutex_unlock(&lib.mutex);
+			return -ENOMEM;
+		}
+		memset(&h[lib.nhandles], 0, (n - lib.nhandles) * sizeof(*h));
+		lib.handles = h;
+		lib.nhandles = n;
+	}
+	lib.handles[fd].name = name;
+	pthread_mutex_unlock(&lib.mutex);
+	return fd;
+}
+
+int pingfs_open(const char *name, int flags, mode_t mode)
+{
+	char *path = fs_name(name);
+	int res;
+
+	if (!path)
+		return -EINVAL;
+	res = fs_open(path);
+	if (res == -ENOENT && (flags & O_CREAT))
+		res = fs_mknod(path, S_IFREG | (mode & 0777));
+	else if (!res && (flags & O_CREAT) && (flags & O_EXCL))
+		res = -EEXIST;
+	if (!res && (flags & O_TRUNC))
+		res = fs_truncate(path, 0);
+	if (res) {
+		free(path);
+		return res;
+	}
+	res = add_handle(path);
+	if (res < 0)
+		free(path);
+	return res;
+}
+
+int pingfs_close(int fd)
+{
+	int res = -EBADF;
+
+	pthread_mutex_lock(&lib.mutex);
+	if (fd >= 0 && fd < lib.nhandles && lib.handles[fd].name) {
+		free(lib.handles[fd].name);
+		lib.handles[fd].name = NULL;
+		res = 0;
+	}
+	pthread_mutex_unlock(&lib.mutex);
+	return res;
+}
+
+int pingfs_stat(const char *name, struct stat *st)
+{
+	char *path = fs_name(name);
+	int res;
+
+	if (!path)
+		return -EINVAL;
+	memset(st, 0, sizeof(*st));
+	res = fs_getattr(path, st);
+	free(path);
+	return res;
+}
+
+int pingfs_fstat(int fd, struct stat *st)
+{
+	char *path = handle_name(fd);
+	int res;
+
+	if (!path)
+		return -EBADF;
+	memset(st, 0, sizeof(*st));
+	res = fs_getattr(path, st);
+	free(path);
+	return res;
+}
+
+int pingfs_unlink(const char *name)
+{
+	char *path = fs_name(name);
+	int res;
+
+	if (!path)
+		return -EINVAL;
+	res = fs_unlink(path);
+	free(path);
+	return res;
+}
+
+/* fs calls cover at most one chunk, loop over the vector */
+static ssize_t do_io(enum pingfs_op op, int fd, const struct iovec *iov,
+	int iovcnt, off_t offset)
+{
+	char *path = handle_name(fd);
+	ssize_t total = 0;
+	int i;
+
+	if (!path)
+		return -EBADF;
+	for (i = 0; i < iovcnt; i++) {
+		size_t done = 0;
+
+		while (done < iov[i].iov_len) {
+			char *base = (char *) iov[i].iov_base + done;
+			size_t len = iov[i].iov_len - done;
+			int res;
+
+			if (op == PINGFS_READ)
+				res = fs_read(path, base, len, offset + total);
+			else
+				res = fs_write(path, base, len, offset + total);
+			if (res <= 0) {
+				free(path);
+				/* End of file, or error after some data */
+				if (!res || total)
+					return total;
+				return res;
+			}
+			done += res;
+			total += res;
+		}
+	}
+	free(path);
+	return total;
+}
+
+ssize_t pingfs_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return do_io(PINGFS_READ, fd, iov, iovcnt, offset);
+}
+
+ssize_t pingfs_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return do_io(PINGFS_WRITE, fd, iov, iovcnt, offset);
+}
+
+/* Must hold lib.mutex */
+static void complete(struct pingfs_req *req)
+{
+	req->next = NULL;
+	*lib.done_tail = req;
+	lib.done_tail = &req->next;
+	pthread_cond_broadcast(&lib.completed);
+}
+
+static void *worker_thread(void *arg)
+{
+	pthread_mutex_lock(&lib.mutex);
+	for (;;) {
+		struct pingfs_req *req;
+
+		while (!lib.queue && !lib.stop)
+			pthread_cond_wait(&lib.submitted, &lib.mutex);
+		if (lib.stop)
+			break;
+		req = lib.queue;
+		lib.queue = req->next;
+		if (!lib.queue)
+			lib.queue_tail = &lib.queue;
+		pthread_mutex_unlock(&lib.mutex);
+
+		req->result = do_io(req->op, req->fd, req->iov, req->iovcnt, req->offset);
+
+		pthread_mutex_lock(&lib.mutex);
+		complete(req);
+	}
+	pthread_mutex_unlock(&lib.mutex);
+	return NULL;
+}
+
+int pingfs_submit(struct pingfs_req *req)
+{
+	if (req->op != PINGFS_READ && req->op != PINGFS_WRITE)
+		return -EINVAL;
+	pthread_mutex_lock(&lib.mutex);
+	if (!lib.started) {
+		pthread_mutex_unlock(&lib.mutex);
+		return -ENOTCONN;
+	}
+	req->next = NULL;
+	*lib.queue_tail = req;
+	lib.queue_tail = &req->next;
+	lib.inflight++;
+	pthread_cond_signal(&lib.submitted);
+	pthread_mutex_unlock(&lib.mutex);
+	return 0;
+}
+
+int pingfs_reap(struct pingfs_req **reqs, int min, int max)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&lib.mutex);
+	/* Never wait for more than are in flight */
+	if (min > lib.inflight)
+		min = lib.inflight;
+	for (;;) {
+		while (n < max && lib.done) {
+			reqs[n++] = lib.done;
+			lib.done = lib.done->next;
+			if (!lib.done)
+				lib.done_tail = &lib.done;
+			lib.inflight--;
+		}
+		if (n >= min)
+			break;
+		pthread_cond_wait(&lib.completed, &lib.mutex);
+	}
+	pthread_mutex_unlock(&lib.mutex);
+	return n;
+}
+
+int pingfs_start(const struct pingfs_options *opts)
+{
+	int res;
+	int i;
+
+	pthread_mutex_lock(&lib.start_lock);
+	if (lib.started) {
+		res = -EALREADY;
+		goto out;
+	}
+	res = setup_start(opts);
+	if (res)
+		goto out;
+	fs_start();
+
+	lib.queue_tail = &lib.queue;
+	lib.done_tail = &lib.done;
+	lib.stop = 0;
+	for (i = 0; i < PINGFS_WORKERS; i++) {
+		if (pthread_create(&lib.workers[i], NULL, worker_thread, NULL)) {
+			perror("Failed to start worker");
+			break;
+		}
+	}
+	lib.nworkers = i;
+	if (!lib.nworkers) {
+		fs_stop();
+		setup_stop();
+		res = -EAGAIN;
+		goto out;
+	}
+	pthread_mutex_lock(&lib.mutex);
+	lib.started = 1;
+	pthread_mutex_unlock(&lib.mutex);
+out:
+	pthread_mutex_unlock(&lib.start_lock);
+	return res;
+}
+
+void pingfs_stop()
+{
+	struct pingfs_req *req;
+	int i;
+
+	pthread_mutex_lock(&lib.start_lock);
+	pthread_mutex_lock(&lib.mutex);
+	if (!lib.started) {
+		pthread_mutex_unlock(&lib.mutex);
+		pthread_mutex_unlock(&lib.start_lock);
+		return;
+	}
+	lib.started = 0;
+	lib.stop = 1;
+	pthread_cond_broadcast(&lib.submitted);
+	pthread_mutex_unlock(&lib.mutex);
+	for (i = 0; i < lib.nworkers; i++)
+		pthread_join(lib.workers[i], NULL);
+
+	/* Requests never started */
+	pthread_mutex_lock(&lib.mutex);
+	while ((req = lib.queue)) {
+		lib.queue = req->next;
+		req->result = -ECANCELED;
+		complete(req);
+	}
+	lib.queue_tail = &lib.queue;
+	for (i = 0; i < lib.nhandles; i++) {
+		free(lib.handles[i].name);
+		lib.handles[i].name = NULL;
+	}
+	pthread_mutex_unlock(&lib.mutex);
+
+	fs_stop();
+	setup_stop();
+	pthread_mutex_unlock(&lib.start_lock);
+}
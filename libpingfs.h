@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_LIBPINGFS_H_
+#define PINGFS_LIBPINGFS_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* Native client API, running the filesystem inside the calling
+ * process without FUSE and the kernel in between. One instance per
+ * process. Files are named like "name" or "/name", in one flat
+ * directory. Functions return 0 or a byte count, or a negative errno.
+ * All functions are thread safe. */
+
+/* Only these functions are exported from libpingfs.so */
+#define PINGFS_API __attribute__((visibility("default")))
+
+enum pingfs_engine {
+	/* select() and recvfrom() */
+	PINGFS_ENGINE_SELECT,
+	/* Memory mapped packet ring, needs root */
+	PINGFS_ENGINE_PACKET,
+	/* io_uring, needs Linux 6.0 */
+	PINGFS_ENGINE_URING,
+};
+
+/* Zero for the defaults, except hostfile */
+struct pingfs_options {
+	/* Hostnames, one per line, or "-" for stdin */
+	const char *hostfile;
+	/* Max seconds to wait for a reply, 0 for the default */
+	int timeout;
+	/* Only use raw sockets, not ICMP datagram sockets */
+	int raw_only;
+	enum pingfs_engine engine;
+	/* Max packets and bytes sent per second, 0 for no limit */
+	unsigned pps;
+	unsigned bps;
+	/* Adjust the packet rate to avoid packet loss */
+	int auto_rate;
+	/* Chunk placement, "weighted" (default) or "rr" */
+	const char *sched;
+	/* Host cache, loaded instead of resolving and evaluating
+	 * unless hostfile is newer, and saved after */
+	const char *cachefile;
+	/* Start when this many hosts have passed the test, and add
+	 * the rest in the background. 0 to test all first */
+	int min_hosts;
+	/* Encrypt file data, with a new random key */
+	int encrypt;
+	/* Unix socket to serve metrics on */
+	const char *metrics;
+};
+
+/* Resolve and evaluate the hosts, and start the network thread */
+PINGFS_API int pingfs_start(const struct pingfs_options *opts);
+/* Stop, all files are lost */
+PINGFS_API void pingfs_stop();
+
+/* O_CREAT, O_EXCL and O_TRUNC are used from flags.
+ * Returns a handle, which follows the name */
+PINGFS_API int pingfs_open(const char *name, int flags, mode_t mode);
+PINGFS_API int pingfs_close(int fd);
+PINGFS_API int pingfs_stat(const char *name, struct stat *st);
+PINGFS_API int pingfs_fstat(int fd, struct stat *st);
+PINGFS_API int pingfs_unlink(const char *name);
+
+PINGFS_API ssize_t pingfs_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+PINGFS_API ssize_t pingfs_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+/* Requests are queued and run in submit order by a pool of
+ * PINGFS_WORKERS threads, each doing a blocking pingfs_preadv() or
+ * pingfs_pwritev(). At most PINGFS_WORKERS requests wait for the
+ * network at once, the rest wait in the queue */
+#define PINGFS_WORKERS 8
+
+enum pingfs_op {
+	PINGFS_READ,
+	PINGFS_WRITE,
+};
+
+struct pingfs_req {
+	enum pingfs_op op;
+	int fd;
+	/* Must stay valid until completed */
+	const struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+	void *user;
+	/* Byte count or negative errno, set when completed */
+	ssize_t result;
+	struct pingfs_req *next;
+};
+
+PINGFS_API int pingfs_submit(struct pingfs_req *req);
+/* Take up to max completed requests, waiting until at least
+ * min have completed. Returns the count */
+PINGFS_API int pingfs_reap(struct pingfs_req **reqs, int min, int max);
+
+#endif /* PINGFS_LIBPINGFS_H_ */
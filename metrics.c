@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "metrics.h"
+#include "host.h"
+#include "chunk.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/* Each power of two range is split in 1 << SUB_BITS buckets */
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+/* Values up to 2^MAX_BITS us (about 76 hours) */
+#define MAX_BITS 38
+#define BUCKETS ((MAX_BITS - SUB_BITS + 2) * SUB_BUCKETS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[BUCKETS];
+};
+
+static struct histogram hists[METRIC_HISTS];
+
+static const struct {
+	const char *name;
+	/* Filesystem operation, or NULL */
+	const char *op;
+} hist_names[METRIC_HISTS] = {
+	[HIST_CHUNK_WAIT] = { "chunk_wait", NULL },
+	[HIST_RTT] = { "rtt", NULL },
+	[HIST_OP_GETATTR] = { "fs_op", "getattr" },
+	[HIST_OP_UTIME] = { "fs_op", "utime" },
+	[HIST_OP_CHMOD] = { "fs_op", "chmod" },
+	[HIST_OP_MKDIR] = { "fs_op", "mkdir" },
+	[HIST_OP_MKNOD] = { "fs_op", "mknod" },
+	[HIST_OP_UNLINK] = { "fs_op", "unlink" },
+	[HIST_OP_READDIR] = { "fs_op", "readdir" },
+	[HIST_OP_OPEN] = { "fs_op", "open" },
+	[HIST_OP_WRITE] = { "fs_op", "write" },
+	[HIST_OP_READ] = { "fs_op", "read" },
+	[HIST_OP_TRUNCATE] = { "fs_op", "truncate" },
+	[HIST_OP_RENAME] = { "fs_op", "rename" },
+};
+
+static const char *counter_names[STAT_COUNTERS] = {
+	[STAT_TX_PACKETS] = "tx_packets",
+	[STAT_TX_BYTES] = "tx_bytes",
+	[STAT_RX_PACKETS] = "rx_packets",
+	[STAT_RX_BYTES] = "rx_bytes",
+	[STAT_DROPS] = "drops",
+	[STAT_PARSE_ERRORS] = "parse_errors",
+	[STAT_CHECKSUM_ERRORS] = "checksum_errors",
+	[STAT_SEQNO_MISMATCH] = "seqno_mismatches",
+	[STAT_PAYLOAD_ERRORS] = "payload_errors",
+	[STAT_SEND_ERRORS] = "send_errors",
+	[STAT_CHUNKS_OVERDUE] = "chunks_overdue",
+	[STAT_CHUNKS_RECOVERED] = "chunks_recovered",
+	[STAT_CHUNKS_LOST] = "chunks_lost",
+	[STAT_CHUNKS_MIGRATED] = "chunks_migrated",
+	[STAT_WAIT_TIMEOUTS] = "wait_timeouts",
+	[STAT_WAIT_BUSY] = "wait_busy",
+};
+
+static const char *state_names[] = {
+	[HOST_OK] = "ok",
+	[HOST_QUARANTINED] = "quarantined",
+	[HOST_CANDIDATE] = "candidate",
+	[HOST_REJECTED] = "rejected",
+};
+
+static struct {
+	pthread_t thread;
+	int fd;
+	char *path;
+	struct host *hosts;
+} server = {
+	.fd = -1,
+};
+
+static int bucket_index(uint64_t v)
+{
+	int bits;
+
+	if (v < SUB_BUCKETS)
+		return v;
+	bits = 63 - __builtin_clzll(v);
+	if (bits > MAX_BITS)
+		return BUCKETS - 1;
+	return (bits - SUB_BITS + 1) * SUB_BUCKETS +
+		((v >> (bits - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Largest value counted in bucket */
+static uint64_t bucket_limit(int i)
+{
+	int bits;
+
+	if (i < SUB_BUCKETS)
+		return i;
+	bits = i / SUB_BUCKETS + SUB_BITS - 1;
+	return ((uint64_t) (SUB_BUCKETS + i % SUB_BUCKETS + 1) << (bits - SUB_BITS)) - 1;
+}
+
+void metrics_record(enum metric_hist hist, uint64_t us)
+{
+	struct histogram *h = &hists[hist];
+	uint64_t max;
+
+	__atomic_fetch_add(&h->buckets[bucket_index(us)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&h->max, &max, us, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+const char *metrics_hist_name(enum metric_hist hist)
+{
+	if (hist >= METRIC_HISTS)
+		return "unknown";
+	return hist_names[hist].op ? hist_names[hist].op : hist_names[hist].name;
+}
+
+static void read_hist(enum metric_hist hist, struct histogram *out)
+{
+	struct histogram *h = &hists[hist];
+	int i;
+
+	out->count = 0;
+	for (i = 0; i < BUCKETS; i++) {
+		out->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		out->count += out->buckets[i];
+	}
+	out->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	out->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+static uint64_t percentile(struct histogram *h, double q)
+{
+	uint64_t seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+	for (i = 0; i < BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= q * h->count)
+			return MIN(bucket_limit(i), h->max);
+	}
+	return h->max;
+}
+
+static void host_addr(struct host *h, char *addr, size_t len)
+{
+	if (getnameinfo((struct sockaddr *) &h->sockaddr, h->sockaddr_len,
+		addr, len, NULL, 0, NI_NUMERICHOST))
+		snprintf(addr, len, "unknown");
+}
+
+static void write_prometheus(FILE *f)
+{
+	uint64_t counters[STAT_COUNTERS];
+	uint64_t chunks;
+	uint64_t bytes;
+	struct host *h;
+	int i;
+	int j;
+
+	stats_get(counters);
+	for (i = 0; i < STAT_COUNTERS; i++) {
+		fprintf(f, "# TYPE pingfs_%s_total counter\n", counter_names[i]);
+		fprintf(f, "pingfs_%s_total %llu\n", counter_names[i],
+			(unsigned long long) counters[i]);
+	}
+
+	chunk_totals(&chunks, &bytes);
+	fprintf(f, "# TYPE pingfs_chunks_active gauge\npingfs_chunks_active %llu\n",
+		(unsigned long long) chunks);
+	fprintf(f, "# TYPE pingfs_chunk_bytes_active gauge\npingfs_chunk_bytes_active %llu\n",
+		(unsigned long long) bytes);
+
+	for (i = 0; i < METRIC_HISTS; i++) {
+		struct histogram hist;
+		char label[64] = "";
+		uint64_t seen = 0;
+
+		read_hist(i, &hist);
+		if (hist_names[i].op)
+			snprintf(label, sizeof(label), "op=\"%s\",", hist_names[i].op);
+		/* Filesystem operations share one metric */
+		if (i == 0 || strcmp(hist_names[i].name, hist_names[i - 1].name) != 0)
+			fprintf(f, "# TYPE pingfs_%s_seconds histogram\n", hist_names[i].name);
+		/* Fixed buckets at powers of two */
+		for (j = 0; j < BUCKETS; j++) {
+			seen += hist.buckets[j];
+			if (j % SUB_BUCKETS == SUB_BUCKETS - 1)
+				fprintf(f, "pingfs_%s_seconds_bucket{%sle=\"%g\"} %llu\n",
+					hist_names[i].name, label, (bucket_limit(j) + 1) / 1e6,
+					(unsigned long long) seen);
+		}
+		fprintf(f, "pingfs_%s_seconds_bucket{%sle=\"+Inf\"} %llu\n",
+			hist_names[i].name, label, (unsigned long long) hist.count);
+		/* Drop trailing comma for the sum and count */
+		if (label[0])
+			label[strlen(label) - 1] = '\0';
+		fprintf(f, "pingfs_%s_seconds_sum%s%s%s %g\n", hist_names[i].name,
+			label[0] ? "{" : "", label, label[0] ? "}" : "", hist.sum / 1e6);
+		fprintf(f, "pingfs_%s_seconds_count%s%s%s %llu\n", hist_names[i].name,
+			label[0] ? "{" : "", label, label[0] ? "}" : "",
+			(unsigned long long) hist.count);
+	}
+
+	fprintf(f, "# TYPE pingfs_host_rtt_seconds gauge\n"
+		"# TYPE pingfs_host_loss_ratio gauge\n"
+		"# TYPE pingfs_host_chunks gauge\n");
+	for (h = server.hosts; h; h = h->next) {
+		char addr[NI_MAXHOST];
+
+		host_addr(h, addr, sizeof(addr));
+		fprintf(f, "pingfs_host_rtt_seconds{host=\"%s\",state=\"%s\"} %g\n",
+			addr, state_names[h->state], h->srtt_us / 1e6);
+		fprintf(f, "pingfs_host_loss_ratio{host=\"%s\",state=\"%s\"} %g\n",
+			addr, state_names[h->state], h->loss);
+		fprintf(f, "pingfs_host_chunks{host=\"%s\",state=\"%s\"} %u\n",
+			addr, state_names[h->state], h->chunks);
+	}
+}
+
+static void write_json(FILE *f, struct host *hosts)
+{
+	uint64_t counters[STAT_COUNTERS];
+	uint64_t chunks;
+	uint64_t bytes;
+	struct host *h;
+	int i;
+
+	stats_get(counters);
+	fprintf(f, "{\"counters\":{");
+	for (i = 0; i < STAT_COUNTERS; i++)
+		fprintf(f, "%s\"%s\":%llu", i ? "," : "", counter_names[i],
+			(unsigned long long) counters[i]);
+
+	chunk_totals(&chunks, &bytes);
+	fprintf(f, "},\"chunks_active\":%llu,\"chunk_bytes_active\":%llu,",
+		(unsigned long long) chunks, (unsigned long long) bytes);
+
+	fprintf(f, "\"histograms\":{");
+	for (i = 0; i < METRIC_HISTS; i++) {
+		struct histogram hist;
+
+		read_hist(i, &hist);
+		fprintf(f, "%s\"%s%s%s\":{\"count\":%llu,\"sum_us\":%llu,\"max_us\":%llu,"
+			"\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu}",
+			i ? "," : "", hist_names[i].name, hist_names[i].op ? "_" : "",
+			hist_names[i].op ? hist_names[i].op : "",
+			(unsigned long long) hist.count, (unsigned long long) hist.sum,
+			(unsigned long long) hist.max,
+			(unsigned long long) percentile(&hist, 0.5),
+			(unsigned long long) percentile(&hist, 0.9),
+			(unsigned long long) percentile(&hist, 0.99),
+			(unsigned long long) percentile(&hist, 0.999));
+	}
+
+	fprintf(f, "},\"hosts\":[");
+	for (h = hosts; h; h = h->next) {
+		char addr[NI_MAXHOST];
+
+		host_addr(h, addr, sizeof(addr));
+		fprintf(f, "%s{\"addr\":\"%s\",\"state\":\"%s\",\"srtt_us\":%u,"
+			"\"rttvar_us\":%u,\"min_rtt_us\":%u,\"loss\":%g,\"chunks\":%u,"
+			"\"cwnd\":%u}", h == hosts ? "" : ",", addr,
+			state_names[h->state], h->srtt_us, h->rttvar_us, h->min_rtt_us,
+			h->loss, h->chunks, h->cwnd_chunks);
+	}
+	fprintf(f, "]}\n");
+}
+
+void metrics_dump(FILE *f, struct host *hosts)
+{
+	write_json(f, hosts);
+}
+
+static void serve_client(int fd)
+{
+	const struct timeval recv_timeout = {
+		.tv_sec = 1,
+		.tv_usec = 0,
+	};
+	char request[256];
+	char *response;
+	size_t len;
+	ssize_t res;
+	FILE *f;
+	int http;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+	res = recv(fd, request, sizeof(request) - 1, 0);
+	if (res < 0)
+		return;
+	request[res] = '\0';
+	request[strcspn(request, "\r\n")] = '\0';
+	http = strncmp(request, "GET ", 4) == 0;
+
+	f = open_memstream(&response, &len);
+	if (!f)
+		return;
+	if (http)
+		fprintf(f, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n\r\n");
+	if (strcmp(request, "json") == 0) {
+		write_json(f, server.hosts);
+	} else if (strcmp(request, "trace on") == 0) {
+		trace_enable(1);
+		fprintf(f, "Tracing on\n");
+	} else if (strcmp(request, "trace off") == 0) {
+		trace_enable(0);
+		fprintf(f, "Tracing off\n");
+	} else if (strcmp(request, "trace dump") == 0) {
+		trace_dump(f);
+	} else {
+		write_prometheus(f);
+	}
+	fclose(f);
+
+	while (len) {
+		res = send(fd, response, len, MSG_NOSIGNAL);
+		if (res <= 0)
+			break;
+		len -= res;
+	}
+	free(response);
+}
+
+static void *server_thread(void *arg)
+{
+	for (;;) {
+		int fd = accept(server.fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("Metrics socket accept failed");
+			break;
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		serve_client(fd);
+		close(fd);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	return NULL;
+}
+
+int metrics_start(const char *path, struct host *hosts)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Metrics socket path too long\n");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	server.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server.fd < 0) {
+		perror("Failed to open metrics socket");
+		return -1;
+	}
+	/* Remove socket left by an earlier mount */
+	unlink(path);
+	if (bind(server.fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+		listen(server.fd, 4)) {
+		perror("Failed to bind metrics socket");
+		close(server.fd);
+		server.fd = -1;
+		return -1;
+	}
+	server.path = strdup(path);
+	server.hosts = hosts;
+	pthread_create(&server.thread, NULL, server_thread, NULL);
+	return 0;
+}
+
+void metrics_stop()
+{
+	if (server.fd < 0)
+		return;
+	pthread_cancel(server.thread);
+	pthread_join(server.thread, NULL);
+	close(server.fd);
+	server.fd = -1;
+	unlink(server.path);
+	free(server.path);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef PINGFS_METRICS_H_
+#define PINGFS_METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct host;
+
+enum metric_hist {
+	/* Time from asking for a chunk until it arrived */
+	HIST_CHUNK_WAIT,
+	/* Round trip time of each reply */
+	HIST_RTT,
+	/* Filesystem operations, from FUSE or the library */
+	HIST_OP_GETATTR,
+	HIST_OP_UTIME,
+	HIST_OP_CHMOD,
+	HIST_OP_MKDIR,
+	HIST_OP_MKNOD,
+	HIST_OP_UNLINK,
+	HIST_OP_READDIR,
+	HIST_OP_OPEN,
+	HIST_OP_WRITE,
+	HIST_OP_READ,
+	HIST_OP_TRUNCATE,
+	HIST_OP_RENAME,
+
+	METRIC_HISTS,
+};
+
+/* Add a sample in microseconds to a latency histogram.
+ * Buckets are log-linear with at most 12.5% error */
+void metrics_record(enum metric_hist hist, uint64_t us);
+
+/* Filesystem operation or histogram name */
+const char *metrics_hist_name(enum metric_hist hist);
+
+/* Serve metrics on a unix socket at path, for the given host list.
+ * Clients send one request line: 'json' for JSON, 'trace on',
+ * 'trace off' or 'trace dump' to control event tracing, anything
+ * else (including an HTTP GET) for Prometheus text format */
+int metrics_start(const char *path, struct host *hosts);
+void metrics_stop();
+
+/* Write the 'json' response to f, listing the given hosts */
+void metrics_dump(FILE *f, struct host *hosts);
+
+#endif /* PINGFS_METRICS_H_ */
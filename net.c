@@ -16,16 +16,38 @@
 #include "net.h"
 #include "icmp.h"
 #include "chunk.h"
+#include "ring.h"
+#include "uring.h"
+#include "stats.h"
+#include "pacer.h"
+#include "sched.h"
+#include "health.h"
+#include "timer.h"
+#include "trace.h"
+#include "sim.h"
 
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <sys/param.h>
 #include <pthread.h>
+#include <linux/filter.h>
 
-static int sockv4;
-static int sockv6;
+struct net_socket {
+	int fd;
+	enum icmp_transport transport;
+	/* Last SO_RXQ_OVFL drop count seen */
+	uint32_t drops;
+};
+
+static struct net_socket sockv4;
+static struct net_socket sockv6;
+static int raw_only;
+static enum net_engine engine;
+/* Set in the network thread */
+static __thread int responder;
 
 struct pkt_stats {
 	long long unsigned int packets;
@@ -35,73 +57,198 @@ struct pkt_stats {
 static struct net_data {
 	pthread_t responder;
 	pthread_t status;
-	pthread_mutex_t stats_mutex;
-	struct pkt_stats tx;
-	struct pkt_stats rx;
+	/* Not cancelled, it can be holding chunk or ring locks */
+	int stop_responder;
 } netdata;
 
-static void inc_stats(struct pkt_stats *stats, int packetsize)
+static void net_inc_tx(int packetsize)
 {
-	pthread_mutex_lock(&netdata.stats_mutex);
-	stats->packets++;
-	stats->bytes += packetsize + ICMP_HDRLEN;
-	pthread_mutex_unlock(&netdata.stats_mutex);
+	stats_inc(STAT_TX_PACKETS);
+	stats_add(STAT_TX_BYTES, packetsize + ICMP_HDRLEN);
 }
 
-static void net_inc_tx(int packetsize)
+void net_inc_rx(int packetsize)
 {
-	inc_stats(&netdata.tx, packetsize);
+	stats_inc(STAT_RX_PACKETS);
+	stats_add(STAT_RX_BYTES, packetsize + ICMP_HDRLEN);
 }
 
-void net_inc_rx(int packetsize)
+void net_count_parse_error(int res)
+{
+	TRACE(TRACE_PARSE_FAIL, (uint32_t) res);
+	if (res == ICMP_BAD_CHECKSUM)
+		stats_inc(STAT_CHECKSUM_ERRORS);
+	else
+		stats_inc(STAT_PARSE_ERRORS);
+}
+
+void net_count_drops(uint32_t total, uint32_t *last)
+{
+	/* Kernel counter is 32 bits and wraps */
+	stats_add(STAT_DROPS, (uint32_t) (total - *last));
+	*last = total;
+}
+
+/* Classic BPF program for the IPv4 raw socket. It sees the full IP packet,
+ * and only lets through echo replies small enough to carry a chunk.
+ * Everything else (other ICMP types, our own outgoing requests,
+ * oversized pings from other programs) is dropped in the kernel. */
+static struct sock_filter v4_filter[] = {
+	/* X = IP header length */
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+	/* ICMP type must be echo reply */
+	BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 5),
+	/* ICMP code must be 0 */
+	BPF_STMT(BPF_LD | BPF_B | BPF_IND, 1),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 3),
+	/* ICMP length = IP total length - IP header length */
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2),
+	BPF_STMT(BPF_ALU | BPF_SUB | BPF_X, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, ICMP_HDRLEN + CHUNK_SIZE, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+};
+
+/* For sockets only used for sending */
+static struct sock_filter drop_filter[] = {
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static void set_filter(int sock, struct sock_filter *filter, int len)
+{
+	struct sock_fprog prog;
+	int res;
+
+	prog.len = len;
+	prog.filter = filter;
+	res = setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+	if (res < 0) {
+		perror("Failed to set BPF filter on socket");
+	}
+}
+
+void net_set_raw_only(int raw)
+{
+	raw_only = raw;
+}
+
+void net_set_engine(enum net_engine e)
+{
+	engine = e;
+}
+
+/* Prefer ICMP datagram sockets (Linux ping sockets), which need no
+ * privileges if net.ipv4.ping_group_range allows it. The kernel sets the id,
+ * handles the checksum and only gives us replies to our own socket.
+ * Fall back to raw sockets if they are not allowed. */
+static void open_socket(int domain, int protocol, struct net_socket *sock)
 {
-	inc_stats(&netdata.rx, packetsize);
+	sock->fd = -1;
+	if (!raw_only) {
+		sock->fd = socket(domain, SOCK_DGRAM, protocol);
+		sock->transport = ICMP_DGRAM;
+	}
+	if (sock->fd < 0) {
+		sock->fd = socket(domain, SOCK_RAW, protocol);
+		sock->transport = ICMP_RAW;
+	}
 }
 
 int net_open_sockets()
 {
 	/* 1MB receive buffer per socket */
 	int rcvbuf = 1024*1024;
+	int one = 1;
+
+	if (engine == NET_ENGINE_SIM)
+		return 0;
+	if (engine == NET_ENGINE_PACKET) {
+		if (ring_open()) {
+			fprintf(stderr, "Packet ring not available, using select\n");
+			engine = NET_ENGINE_SELECT;
+		} else {
+			/* The ring sees the packets as they come in from the
+			 * network, so it can not demux datagram socket replies */
+			raw_only = 1;
+		}
+	}
 
-	// v4 socket will return full IP header
-	sockv4 = socket(PF_INET, SOCK_RAW, IPPROTO_ICMP);
-	if (sockv4 < 0) {
+	// v4 raw socket will return full IP header
+	open_socket(PF_INET, IPPROTO_ICMP, &sockv4);
+	if (sockv4.fd < 0) {
 		perror("Failed to open IPv4 socket");
 	} else {
-		int res = setsockopt(sockv4, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		int res = setsockopt(sockv4.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 		if (res < 0) {
 			perror("Failed to set receive buffer size on IPv4 socket");
 		}
+		/* Get count of dropped packets with each packet */
+		setsockopt(sockv4.fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+		if (engine == NET_ENGINE_PACKET)
+			set_filter(sockv4.fd, drop_filter, 1);
+		else if (sockv4.transport == ICMP_RAW)
+			set_filter(sockv4.fd, v4_filter, sizeof(v4_filter) / sizeof(v4_filter[0]));
 	}
 
 	// v6 socket will just give ICMPv6 data, no IP header
-	sockv6 = socket(PF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-	if (sockv6 >= 0) {
-		struct icmp6_filter filter;
-		int res = setsockopt(sockv6, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	open_socket(PF_INET6, IPPROTO_ICMPV6, &sockv6);
+	if (sockv6.fd >= 0) {
+		int res = setsockopt(sockv6.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 		if (res < 0) {
 			perror("Failed to set receive buffer size on IPv6 socket");
 		}
-
-		ICMP6_FILTER_SETBLOCKALL(&filter);
-		ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
-		res = setsockopt(sockv6, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
-		if (res < 0) {
-			perror("Failed to set ICMP filters on IPv6 socket");
+		setsockopt(sockv6.fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+
+		if (sockv6.transport == ICMP_RAW) {
+			struct icmp6_filter filter;
+			ICMP6_FILTER_SETBLOCKALL(&filter);
+			if (engine != NET_ENGINE_PACKET)
+				ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+			res = setsockopt(sockv6.fd, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
+			if (res < 0) {
+				perror("Failed to set ICMP filters on IPv6 socket");
+			}
 		}
 	} else {
 		perror("Failed to open IPv6 socket");
 	}
 
-	if (sockv4 < 0 && sockv6 < 0)
+	if (sockv4.fd < 0 && sockv6.fd < 0) {
+		net_close_sockets();
 		return 1;
+	}
+
+	if (engine == NET_ENGINE_URING) {
+		if (uring_open(sockv4.fd, sockv4.transport, sockv6.fd, sockv6.transport)) {
+			fprintf(stderr, "io_uring not available, using select\n");
+			engine = NET_ENGINE_SELECT;
+		}
+	}
 
 	return 0;
 }
 
-void net_send(struct host *host, uint16_t id, uint16_t seqno, const uint8_t *data, size_t len)
+void net_close_sockets()
+{
+	if (engine == NET_ENGINE_SIM)
+		return;
+	if (engine == NET_ENGINE_PACKET)
+		ring_close();
+	else if (engine == NET_ENGINE_URING)
+		uring_close();
+	if (sockv4.fd >= 0)
+		close(sockv4.fd);
+	if (sockv6.fd >= 0)
+		close(sockv6.fd);
+	sockv4.fd = -1;
+	sockv6.fd = -1;
+}
+
+static void xmit(struct host *host, uint16_t id, uint16_t seqno,
+	const uint8_t *data, size_t len, uint16_t csum)
 {
-	int sock;
+	struct net_socket *sock;
 	struct icmp_packet pkt;
 
 	memcpy(&pkt.peer, &host->sockaddr, host->sockaddr_len);
@@ -109,38 +256,117 @@ void net_send(struct host *host, uint16_t id, uint16_t seqno, const uint8_t *dat
 	pkt.type = ICMP_REQUEST;
 	pkt.id = id;
 	pkt.seqno = seqno;
+	pkt.checksum = csum;
 	pkt.payload = (uint8_t *) data;
 	pkt.payload_len = len;
 
+	TRACE(TRACE_SEND, id << 16 | seqno);
+	if (engine == NET_ENGINE_SIM) {
+		net_inc_tx(len);
+		sim_send(host, id, seqno, data, len);
+		return;
+	}
 	if (ICMP_ADDRFAMILY(&pkt) == AF_INET) {
-		sock = sockv4;
+		sock = &sockv4;
 	} else {
-		sock = sockv6;
+		sock = &sockv6;
 	}
+	pkt.transport = sock->transport;
 
-	if (sock >= 0) {
+	if (sock->fd >= 0) {
+		int res;
 		net_inc_tx(pkt.payload_len);
-		if (!icmp_send(sock, &pkt))
+		if (engine == NET_ENGINE_URING)
+			res = uring_send(sock->fd, &pkt);
+		else
+			res = icmp_send(sock->fd, &pkt);
+		if (res < 0) {
+			stats_inc(STAT_SEND_ERRORS);
 			perror("Failed sending data packet");
+		}
 	}
 
 }
 
-static void handle_recv(int sock, net_recv_fn_t recv_fn, void *recv_data)
+/* Sent from the pacer thread, the reply timer starts now */
+static void paced_xmit(struct host *host, uint16_t id, uint16_t seqno,
+	const uint8_t *data, size_t len, uint16_t csum)
+{
+	xmit(host, id, seqno, data, len, csum);
+	chunk_on_wire(id, seqno);
+}
+
+static void send_pkt(struct host *host, uint16_t id, uint16_t seqno,
+	const uint8_t *data, size_t len, uint16_t csum)
+{
+	/* The network thread sends with chunk_mutex held, it must
+	 * never wait for room in the queue */
+	if (pacer_enabled() && pacer_queue(host, id, seqno, data, len, csum, !responder) == 0)
+		return;
+	xmit(host, id, seqno, data, len, csum);
+}
+
+void net_send(struct host *host, uint16_t id, uint16_t seqno, const uint8_t *data, size_t len)
+{
+	send_pkt(host, id, seqno, data, len, 0);
+}
+
+void net_resend(struct host *host, uint16_t id, uint16_t seqno, const uint8_t *data, size_t len,
+	uint16_t reply_seqno, uint16_t reply_csum)
+{
+	uint16_t csum = 0;
+	if (host->sockaddr.ss_family == AF_INET && sockv4.transport == ICMP_RAW)
+		csum = icmp_request_checksum(reply_csum, reply_seqno, seqno);
+	send_pkt(host, id, seqno, data, len, csum);
+}
+
+void net_check_drops(struct msghdr *msg, uint32_t *last)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t drops;
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+			net_count_drops(drops, last);
+		}
+	}
+}
+
+static void handle_recv(struct net_socket *sock, net_recv_fn_t recv_fn, void *recv_data)
 {
 	struct icmp_packet mypkt;
-	mypkt.peer_len = sizeof(struct sockaddr_storage);
 	uint8_t buf[BUFSIZ];
+	uint8_t control[CMSG_SPACE(sizeof(uint32_t))];
+	struct iovec iov;
+	struct msghdr msg;
 	int len;
-
-	len = recvfrom(sock, buf, sizeof(buf), 0,
-		(struct sockaddr *) &mypkt.peer, &mypkt.peer_len);
-	if (len > 0 && icmp_parse(&mypkt, buf, len) == 0) {
-		if (mypkt.type == ICMP_REPLY) {
-			recv_fn(recv_data, &mypkt.peer, mypkt.peer_len, mypkt.id,
-				mypkt.seqno, &mypkt.payload, mypkt.payload_len);
-		}
-		free(mypkt.payload);
+	int res;
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &mypkt.peer;
+	msg.msg_namelen = sizeof(struct sockaddr_storage);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	/* Never block after select(), so the responder can stop */
+	len = recvmsg(sock->fd, &msg, MSG_DONTWAIT);
+	if (len <= 0)
+		return;
+	net_check_drops(&msg, &sock->drops);
+
+	mypkt.peer_len = msg.msg_namelen;
+	mypkt.transport = sock->transport;
+	res = icmp_parse(&mypkt, buf, len);
+	if (res) {
+		net_count_parse_error(res);
+	} else if (mypkt.type == ICMP_REPLY) {
+		recv_fn(recv_data, &mypkt.peer, mypkt.peer_len, mypkt.id,
+			mypkt.seqno, mypkt.checksum, &mypkt.payload, mypkt.payload_len);
 	}
 }
 
@@ -150,36 +376,68 @@ int net_recv(struct timeval *tv, net_recv_fn_t recv_fn, void *recv_data)
 	fd_set fds;
 	int i;
 
+	if (engine == NET_ENGINE_PACKET)
+		return ring_recv(tv, recv_fn, recv_data);
+	if (engine == NET_ENGINE_URING)
+		return uring_recv(tv, recv_fn, recv_data);
+	if (engine == NET_ENGINE_SIM)
+		return sim_recv(tv, recv_fn, recv_data);
+
 	FD_ZERO(&fds);
-	if (sockv4 >= 0) FD_SET(sockv4, &fds);
-	if (sockv6 >= 0) FD_SET(sockv6, &fds);
-	maxfd = MAX(sockv4, sockv6);
+	if (sockv4.fd >= 0) FD_SET(sockv4.fd, &fds);
+	if (sockv6.fd >= 0) FD_SET(sockv6.fd, &fds);
+	maxfd = MAX(sockv4.fd, sockv6.fd);
 
 	i = select(maxfd+1, &fds, NULL, NULL, tv);
-	if ((sockv4 >= 0) && FD_ISSET(sockv4, &fds))
-		handle_recv(sockv4, recv_fn, recv_data);
-	if ((sockv6 >= 0) && FD_ISSET(sockv6, &fds))
-		handle_recv(sockv6, recv_fn, recv_data);
+	if ((sockv4.fd >= 0) && FD_ISSET(sockv4.fd, &fds))
+		handle_recv(&sockv4, recv_fn, recv_data);
+	if ((sockv6.fd >= 0) && FD_ISSET(sockv6.fd, &fds))
+		handle_recv(&sockv6, recv_fn, recv_data);
 	return i;
 }
 
+void net_tv_sub(struct timeval *tv, const struct timespec *start)
+{
+	struct timespec now;
+	long long left_us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left_us = tv->tv_sec * 1000000LL + tv->tv_usec;
+	left_us -= (now.tv_sec - start->tv_sec) * 1000000LL;
+	left_us -= (now.tv_nsec - start->tv_nsec) / 1000;
+	if (left_us < 0)
+		left_us = 0;
+	tv->tv_sec = left_us / 1000000;
+	tv->tv_usec = left_us % 1000000;
+}
+
 static void *responder_thread(void *arg)
 {
-	for (;;) {
+	responder = 1;
+	while (!__atomic_load_n(&netdata.stop_responder, __ATOMIC_RELAXED)) {
 		struct timeval tv;
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
+		/* Wake up often enough to notice late chunks and stop */
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
 		net_recv(&tv, chunk_reply, NULL);
+		health_tick(timer_now_us());
+		sched_tick(timer_now_us());
+		/* Last, so a simulated reader woken by a lost
+		 * chunk runs alone until it blocks again */
+		chunk_check_timers();
 	}
 	return NULL;
 }
 
 static void get_stats(struct pkt_stats *rx, struct pkt_stats *tx)
 {
-	pthread_mutex_lock(&netdata.stats_mutex);
-	memcpy(rx, &netdata.rx, sizeof(netdata.rx));
-	memcpy(tx, &netdata.tx, sizeof(netdata.tx));
-	pthread_mutex_unlock(&netdata.stats_mutex);
+	uint64_t counters[STAT_COUNTERS];
+
+	stats_get(counters);
+	rx->packets = counters[STAT_RX_PACKETS];
+	rx->bytes = counters[STAT_RX_BYTES];
+	tx->packets = counters[STAT_TX_PACKETS];
+	tx->bytes = counters[STAT_TX_BYTES];
 }
 
 static float format_bytes(unsigned long long bytes, const char **suffix)
@@ -240,29 +498,50 @@ static void *status_thread(void *arg)
 
 void net_start()
 {
-	if (pthread_mutex_init(&netdata.stats_mutex, NULL)) {
-		perror("Fatal, failed to create a mutex");
-		exit(EXIT_FAILURE);
-	}
-
+	if (pacer_enabled())
+		pacer_start(paced_xmit);
+	netdata.stop_responder = 0;
 	pthread_create(&netdata.responder, NULL, responder_thread, NULL);
-	pthread_create(&netdata.status, NULL, status_thread, NULL);
+	/* Rates in wall clock time mean nothing when simulated */
+	if (engine != NET_ENGINE_SIM)
+		pthread_create(&netdata.status, NULL, status_thread, NULL);
 }
 
 void net_stop()
 {
-	pthread_cancel(netdata.responder);
+	uint64_t counters[STAT_COUNTERS];
+
+	__atomic_store_n(&netdata.stop_responder, 1, __ATOMIC_RELAXED);
 	pthread_join(netdata.responder, NULL);
-	pthread_cancel(netdata.status);
-	pthread_join(netdata.status, NULL);
+	if (engine != NET_ENGINE_SIM) {
+		pthread_cancel(netdata.status);
+		pthread_join(netdata.status, NULL);
+	}
+	pacer_stop();
 
-	pthread_mutex_lock(&netdata.stats_mutex);
+	stats_get(counters);
 	printf("\n\nTotal network resources consumed:\n"
 		"in:  %10llu packets, %10llu bytes\n"
 		"out: %10llu packets, %10llu bytes\n"
 		" (bytes counted above IP level)\n",
-		netdata.rx.packets, netdata.rx.bytes,
-		netdata.tx.packets, netdata.tx.bytes
+		(unsigned long long) counters[STAT_RX_PACKETS],
+		(unsigned long long) counters[STAT_RX_BYTES],
+		(unsigned long long) counters[STAT_TX_PACKETS],
+		(unsigned long long) counters[STAT_TX_BYTES]
+	);
+	printf("Dropped by kernel: %llu, send errors: %llu, parse errors: %llu, "
+		"checksum errors: %llu, seqno mismatches: %llu, payload errors: %llu\n",
+		(unsigned long long) counters[STAT_DROPS],
+		(unsigned long long) counters[STAT_SEND_ERRORS],
+		(unsigned long long) counters[STAT_PARSE_ERRORS],
+		(unsigned long long) counters[STAT_CHECKSUM_ERRORS],
+		(unsigned long long) counters[STAT_SEQNO_MISMATCH],
+		(unsigned long long) counters[STAT_PAYLOAD_ERRORS]
+	);
+	printf("Chunks overdue: %llu, recovered: %llu, lost: %llu, migrated: %llu\n",
+		(unsigned long long) counters[STAT_CHUNKS_OVERDUE],
+		(unsigned long long) counters[STAT_CHUNKS_RECOVERED],
+		(unsigned long long) counters[STAT_CHUNKS_LOST],
+		(unsigned long long) counters[STAT_CHUNKS_MIGRATED]
 	);
-	pthread_mutex_unlock(&netdata.stats_mutex);
 }
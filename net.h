@@ -20,18 +20,54 @@
 #include "host.h"
 
 #include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 
+enum net_engine {
+	/* Receive with select() and recvfrom() */
+	NET_ENGINE_SELECT,
+	/* Receive from memory mapped packet socket ring */
+	NET_ENGINE_PACKET,
+	/* Send and receive with io_uring */
+	NET_ENGINE_URING,
+	/* Simulated network in virtual time, see sim.h */
+	NET_ENGINE_SIM,
+};
+
+/* Only use raw sockets, never ICMP datagram sockets */
+void net_set_raw_only(int raw);
+void net_set_engine(enum net_engine e);
 int net_open_sockets();
+/* Close sockets and rings, after net_stop() */
+void net_close_sockets();
 void net_send(struct host *host, uint16_t id, uint16_t seqno, const uint8_t *data, size_t len);
+/* Send unmodified data from a received reply again with a new seqno,
+ * updating the reply checksum instead of calculating a new one */
+void net_resend(struct host *host, uint16_t id, uint16_t seqno, const uint8_t *data, size_t len,
+	uint16_t reply_seqno, uint16_t reply_csum);
 
+/* Payload data is only valid during the callback. It can be modified
+ * in place, but not grown */
 typedef void (*net_recv_fn_t)(void *userdata, struct sockaddr_storage *addr,
-	size_t addrlen, uint16_t id, uint16_t seqno, uint8_t **data, size_t len);
+	size_t addrlen, uint16_t id, uint16_t seqno, uint16_t csum, uint8_t **data, size_t len);
 
+/* Wait up to tv for packets, and pass echo replies to recv_fn.
+ * Returns 0 on timeout. Like select(), tv is updated with the time left */
 int net_recv(struct timeval *tv, net_recv_fn_t recv_fn, void *recv_data);
 
+/* Lower tv by the time passed since start (CLOCK_MONOTONIC) */
+void net_tv_sub(struct timeval *tv, const struct timespec *start);
+
 void net_inc_rx(int packetsize);
 
+/* For engines: count icmp_parse() failure, and kernel drop
+ * counter (SO_RXQ_OVFL or similar) since last value */
+void net_count_parse_error(int res);
+void net_count_drops(uint32_t total, uint32_t *last);
+/* Count drops from SO_RXQ_OVFL control message, if any */
+struct msghdr;
+void net_check_drops(struct msghdr *msg, uint32_t *last);
+
 void net_start();
 void net_stop();
 
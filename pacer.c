@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "pacer.h"
+#include "chunk.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Waiting senders are held back beyond this, the network
+ * thread never waits and grows the queue instead */
+#define PACER_QUEUE 4096
+/* Bucket holds at most this much time worth of tokens */
+#define PACER_BURST_US 2000
+/* Auto tuning starting rate, lower bound and increase per period */
+#define PACER_AUTO_START 10000
+#define PACER_AUTO_MIN 100
+#define PACER_AUTO_STEP 500
+#define PACER_AUTO_PERIOD_US 100000
+
+struct pacer_pkt {
+	struct host *host;
+	uint16_t id;
+	uint16_t seqno;
+	uint16_t csum;
+	uint16_t len;
+	uint8_t data[CHUNK_SIZE];
+};
+
+struct bucket {
+	/* Tokens per second, 0 for unlimited */
+	unsigned rate;
+	double tokens;
+};
+
+static struct pacer_data {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct pacer_pkt *queue;
+	unsigned size;
+	unsigned head;
+	unsigned count;
+	int running;
+	pacer_send_fn_t send_fn;
+
+	struct bucket packets;
+	struct bucket bytes;
+	struct timespec last_fill;
+
+	int auto_tune;
+	/* Set when packets had to wait for tokens */
+	int limited;
+	uint64_t last_losses;
+	struct timespec last_tune;
+} pacer = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
+void pacer_set_rate(unsigned pps, unsigned bps)
+{
+	pacer.auto_tune = 0;
+	pacer.packets.rate = pps;
+	pacer.bytes.rate = bps;
+}
+
+void pacer_set_auto()
+{
+	pacer.auto_tune = 1;
+	pacer.packets.rate = PACER_AUTO_START;
+}
+
+int pacer_enabled()
+{
+	return pacer.packets.rate || pacer.bytes.rate;
+}
+
+static long long elapsed_us(const struct timespec *now, const struct timespec *then)
+{
+	return (now->tv_sec - then->tv_sec) * 1000000LL +
+		(now->tv_nsec - then->tv_nsec) / 1000;
+}
+
+static void fill(struct bucket *b, long long us, unsigned burst)
+{
+	double max;
+
+	if (!b->rate)
+		return;
+	max = (double) b->rate * PACER_BURST_US / 1000000;
+	if (max < burst)
+		max = burst;
+	b->tokens += (double) b->rate * us / 1000000;
+	if (b->tokens > max)
+		b->tokens = max;
+}
+
+/* Microseconds until the bucket has the needed tokens */
+static long long wait_us(struct bucket *b, unsigned needed)
+{
+	if (!b->rate || b->tokens >= needed)
+		return 0;
+	return (long long) ((needed - b->tokens) * 1000000 / b->rate) + 1;
+}
+
+static uint64_t get_losses()
+{
+	uint64_t counters[STAT_COUNTERS];
+
+	stats_get(counters);
+	return counters[STAT_DROPS] + counters[STAT_SEND_ERRORS];
+}
+
+/* AIMD: halve the rate when the kernel lost packets, otherwise
+ * raise it a bit if it was holding packets back */
+static void tune(const struct timespec *now)
+{
+	uint64_t losses;
+
+	if (elapsed_us(now, &pacer.last_tune) < PACER_AUTO_PERIOD_US)
+		return;
+	pacer.last_tune = *now;
+
+	losses = get_losses();
+	if (losses != pacer.last_losses) {
+		pacer.packets.rate /= 2;
+		if (pacer.packets.rate < PACER_AUTO_MIN)
+			pacer.packets.rate = PACER_AUTO_MIN;
+	} else if (pacer.limited) {
+		pacer.packets.rate += PACER_AUTO_STEP;
+	}
+	pacer.last_losses = losses;
+	pacer.limited = 0;
+}
+
+static void *pacer_thread(void *arg)
+{
+	struct pacer_pkt pkt;
+
+	pthread_mutex_lock(&pacer.mutex);
+	while (pacer.running) {
+		struct timespec now;
+		long long us;
+		long long wait;
+
+		if (!pacer.count) {
+			pthread_cond_wait(&pacer.not_empty, &pacer.mutex);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		us = elapsed_us(&now, &pacer.last_fill);
+		pacer.last_fill = now;
+		fill(&pacer.packets, us, 1);
+		fill(&pacer.bytes, us, CHUNK_SIZE);
+		if (pacer.auto_tune)
+			tune(&now);
+
+		wait = wait_us(&pacer.packets, 1);
+		if (wait < wait_us(&pacer.bytes, pacer.queue[pacer.head].len))
+			wait = wait_us(&pacer.bytes, pacer.queue[pacer.head].len);
+		if (wait) {
+			struct timespec ts;
+			pacer.limited = 1;
+			pthread_mutex_unlock(&pacer.mutex);
+			ts.tv_sec = wait / 1000000;
+			ts.tv_nsec = (wait % 1000000) * 1000;
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&pacer.mutex);
+			continue;
+		}
+
+		if (pacer.packets.rate)
+			pacer.packets.tokens -= 1;
+		if (pacer.bytes.rate)
+			pacer.bytes.tokens -= pacer.queue[pacer.head].len;
+		memcpy(&pkt, &pacer.queue[pacer.head], sizeof(pkt));
+		pacer.head = (pacer.head + 1) % pacer.size;
+		pacer.count--;
+		if (pacer.count < PACER_QUEUE)
+			pthread_cond_signal(&pacer.not_full);
+
+		pthread_mutex_unlock(&pacer.mutex);
+		pacer.send_fn(pkt.host, pkt.id, pkt.seqno, pkt.data, pkt.len, pkt.csum);
+		pthread_mutex_lock(&pacer.mutex);
+	}
+	pthread_mutex_unlock(&pacer.mutex);
+	return NULL;
+}
+
+void pacer_start(pacer_send_fn_t send_fn)
+{
+	pacer.queue = malloc(PACER_QUEUE * sizeof(struct pacer_pkt));
+	if (!pacer.queue) {
+		fprintf(stderr, "Failed to allocate send queue, not pacing\n");
+		return;
+	}
+	pacer.size = PACER_QUEUE;
+	pacer.send_fn = send_fn;
+	clock_gettime(CLOCK_MONOTONIC, &pacer.last_fill);
+	pacer.last_tune = pacer.last_fill;
+	pacer.last_losses = get_losses();
+	pacer.running = 1;
+	pthread_create(&pacer.thread, NULL, pacer_thread, NULL);
+}
+
+void pacer_stop()
+{
+	if (!pacer.queue)
+		return;
+	pthread_mutex_lock(&pacer.mutex);
+	pacer.running = 0;
+	pthread_cond_broadcast(&pacer.not_empty);
+	pthread_cond_broadcast(&pacer.not_full);
+	pthread_mutex_unlock(&pacer.mutex);
+	pthread_join(pacer.thread, NULL);
+	/* Anything still queued is dropped */
+	free(pacer.queue);
+	pacer.queue = NULL;
+	pacer.count = 0;
+}
+
+static void unlock(void *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+/* Must hold pacer.mutex. Double the queue, keeping the order */
+static int grow()
+{
+	struct pacer_pkt *queue;
+	unsigned size = pacer.size * 2;
+	unsigned first = pacer.size - pacer.head;
+
+	queue = malloc(size * sizeof(struct pacer_pkt));
+	if (!queue)
+		return 1;
+	if (first > pacer.count)
+		first = pacer.count;
+	memcpy(queue, &pacer.queue[pacer.head], first * sizeof(struct pacer_pkt));
+	memcpy(&queue[first], pacer.queue, (pacer.count - first) * sizeof(struct pacer_pkt));
+	free(pacer.queue);
+	pacer.queue = queue;
+	pacer.size = size;
+	pacer.head = 0;
+	return 0;
+}
+
+int pacer_queue(struct host *host, uint16_t id, uint16_t seqno,
+	const uint8_t *data, size_t len, uint16_t csum, int wait)
+{
+	struct pacer_pkt *pkt;
+
+	pthread_mutex_lock(&pacer.mutex);
+	/* Sending thread can be cancelled while waiting */
+	pthread_cleanup_push(unlock, &pacer.mutex);
+	while (wait && pacer.running && pacer.count >= PACER_QUEUE)
+		pthread_cond_wait(&pacer.not_full, &pacer.mutex);
+	pthread_cleanup_pop(0);
+	if (!pacer.running || (pacer.count == pacer.size && grow())) {
+		pthread_mutex_unlock(&pacer.mutex);
+		return 1;
+	}
+
+	pkt = &pacer.queue[(pacer.head + pacer.count) % pacer.size];
+	pkt->host = host;
+	pkt->id = id;
+	pkt->seqno = seqno;
+	pkt->csum = csum;
+	pkt->len = len;
+	memcpy(pkt->data, data, len);
+	pacer.count++;
+	pthread_cond_signal(&pacer.not_empty);
+	pthread_mutex_unlock(&pacer.mutex);
+	return 0;
+}
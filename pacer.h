@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_PACER_H_
+#define PINGFS_PACER_H_
+
+#include "host.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Function doing the actual sending of a queued packet */
+typedef void (*pacer_send_fn_t)(struct host *host, uint16_t id, uint16_t seqno,
+	const uint8_t *data, size_t len, uint16_t csum);
+
+/* Limit sending to this many packets and bytes per second,
+ * 0 means no limit. Pacing is off if neither limit is set */
+void pacer_set_rate(unsigned pps, unsigned bps);
+/* Start with a packet rate limit and adjust it while running,
+ * lowering it when packets are lost in the kernel */
+void pacer_set_auto();
+int pacer_enabled();
+
+void pacer_start(pacer_send_fn_t send_fn);
+void pacer_stop();
+
+/* Copy packet to the send queue. With wait set it blocks while
+ * the queue is full, otherwise the queue grows. Returns nonzero
+ * if the pacer is not running or out of memory, the packet must
+ * then be sent directly */
+int pacer_queue(struct host *host, uint16_t id, uint16_t seqno,
+	const uint8_t *data, size_t len, uint16_t csum, int wait);
+
+#endif /* PINGFS_PACER_H_ */
@@ -19,102 +19,48 @@
 #include <netdb.h>
 #include <pwd.h>
 
-#include "host.h"
-#include "fs.h"
-#include "net.h"
+#include "fs_fuse.h"
 #include "chunk.h"
-
-#include <arpa/inet.h>
-
-#define DEFAULT_TIMEOUT_S 1
+#include "sched.h"
+#include "setup.h"
 
 struct arginfo {
-	char *hostfile;
+	struct pingfs_options opts;
 	char *mountpoint;
 	int num_args;
-	int timeout;
 };
 
 enum {
 	KEY_HELP,
 	KEY_ASUSER,
 	KEY_TIMEOUT,
+	KEY_RAW,
+	KEY_ENGINE,
+	KEY_RATE,
+	KEY_BYTERATE,
+	KEY_SCHED,
+	KEY_CACHE,
+	KEY_MIN_HOSTS,
+	KEY_ENCRYPT,
+	KEY_METRICS,
 };
 
 static const struct fuse_opt pingfs_opts[] = {
 	FUSE_OPT_KEY("-h",  KEY_HELP),
 	FUSE_OPT_KEY("-u ", KEY_ASUSER),
 	FUSE_OPT_KEY("-t ", KEY_TIMEOUT),
+	FUSE_OPT_KEY("-R",  KEY_RAW),
+	FUSE_OPT_KEY("-e ", KEY_ENGINE),
+	FUSE_OPT_KEY("-r ", KEY_RATE),
+	FUSE_OPT_KEY("-b ", KEY_BYTERATE),
+	FUSE_OPT_KEY("-P ", KEY_SCHED),
+	FUSE_OPT_KEY("-c ", KEY_CACHE),
+	FUSE_OPT_KEY("-n ", KEY_MIN_HOSTS),
+	FUSE_OPT_KEY("-E",  KEY_ENCRYPT),
+	FUSE_OPT_KEY("-M ", KEY_METRICS),
 	FUSE_OPT_END,
 };
 
-static int read_hostnames(const char *hfile, struct gaicb **list[])
-{
-	int h = 0;
-	FILE *file;
-
-	if (strcmp("-", hfile) == 0) {
-		file = stdin;
-	} else {
-		file = fopen(hfile, "r");
-		if (!file) {
-			perror("Failed to read file");
-			return h;
-		}
-	}
-
-	h = host_make_resolvlist(file, list);
-	fclose(file);
-
-	return h;
-}
-
-static int resolve_names(struct gaicb **list, int names, struct host **hosts)
-{
-	int ret;
-	int hostcount;
-	int i;
-
-	fprintf(stderr, "Resolving %d hostnames... ", names);
-	fflush(stderr);
-
-	ret = getaddrinfo_a(GAI_WAIT, list, names, NULL);
-	if (ret != 0) {
-		fprintf(stderr, "Resolving failed: %s\n", gai_strerror(ret));
-		return -1;
-	}
-
-	fprintf(stderr, "done.\n");
-
-	hostcount = 0;
-	for (i = 0; i < names; i++) {
-		ret = gai_error(list[i]);
-		if (ret) {
-			fprintf(stderr, "Skipping %s: %s\n", list[i]->ar_name, gai_strerror(ret));
-		} else {
-			struct addrinfo *result = list[i]->ar_result;
-			do {
-				hostcount++;
-				result = result->ai_next;
-			} while (result);
-		}
-	}
-	if (!hostcount) {
-		fprintf(stderr, "No hosts found! Exiting\n");
-		return -1;
-	}
-
-	*hosts = host_create(list, names);
-	host_free_resolvlist(list, names);
-
-	if (*hosts == NULL) {
-		fprintf(stderr, "Failed creating list list, exiting\n");
-		return -1;
-	}
-
-	return hostcount;
-}
-
 static void print_usage(char *progname)
 {
 	fprintf(stderr, "Usage: %s [options] hostfile mountpoint\n"
@@ -122,7 +68,26 @@ static void print_usage(char *progname)
 		" -h           : Print this help and exit\n"
 		" -u username  : Mount the filesystem as this user\n"
 		" -t timeout   : Max time to wait for icmp reply "
-			"(seconds, default 1)\n", progname);
+			"(seconds, default 1).\n"
+		"                Shorter timeouts are used based on measured RTT\n"
+		" -R           : Only use raw sockets, not ICMP datagram sockets\n"
+		" -e engine    : Network engine, 'select' (default), 'packet'\n"
+		"                (memory mapped packet ring, needs root)\n"
+		"                or 'uring' (io_uring, needs Linux 6.0)\n"
+		" -r rate      : Max packets sent per second, or 'auto' to\n"
+		"                adjust it to avoid packet loss\n"
+		" -b rate      : Max bytes sent per second\n"
+		" -P policy    : Chunk placement, 'weighted' (default, by RTT,\n"
+		"                loss and chunks stored) or 'rr' (round robin)\n"
+		" -c file      : Host cache. Hosts are loaded from it instead of\n"
+		"                being resolved and evaluated, unless the host\n"
+		"                file is newer. Written after evaluation and unmount\n"
+		" -n count     : Mount when this many hosts have passed the test,\n"
+		"                and add the rest of the hosts in the background\n"
+		" -E           : Encrypt file data sent to hosts, with a new\n"
+		"                random key for each mount\n"
+		" -M path      : Serve metrics on a unix socket. Send a line with\n"
+		"                'json' for JSON, otherwise Prometheus text is sent\n", progname);
 }
 
 static int pingfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
@@ -134,9 +99,9 @@ static int pingfs_opt_proc(void *data, const char *arg, int key, struct fuse_arg
 	switch (key) {
 	case FUSE_OPT_KEY_NONOPT:
 		arginfo->num_args++;
-		if (!arginfo->hostfile) {
+		if (!arginfo->opts.hostfile) {
 			/* Get first non-option argument as hostfile */
-			arginfo->hostfile = strdup(arg);
+			arginfo->opts.hostfile = strdup(arg);
 			return 0;
 		} else if (!arginfo->mountpoint) {
 			arginfo->mountpoint = strdup(arg);
@@ -159,32 +124,90 @@ static int pingfs_opt_proc(void *data, const char *arg, int key, struct fuse_arg
 		}
 		break;
 	case KEY_TIMEOUT:
-		res = sscanf(arg, "-t%d", &arginfo->timeout);
-		if (res == 1 && arginfo->timeout > 0 && arginfo->timeout < 60) {
+		res = sscanf(arg, "-t%d", &arginfo->opts.timeout);
+		if (res == 1 && arginfo->opts.timeout > 0 && arginfo->opts.timeout < 60) {
 			return 0;
 		} else {
 			fprintf(stderr, "Bad timeout given! Exiting\n");
 			print_usage(outargs->argv[0]);
 			exit(1);
 		}
+	case KEY_RAW:
+		arginfo->opts.raw_only = 1;
+		return 0;
+	case KEY_ENCRYPT:
+		arginfo->opts.encrypt = 1;
+		return 0;
+	case KEY_ENGINE:
+		if (strcmp(&arg[2], "select") == 0) {
+			arginfo->opts.engine = PINGFS_ENGINE_SELECT;
+		} else if (strcmp(&arg[2], "packet") == 0) {
+			arginfo->opts.engine = PINGFS_ENGINE_PACKET;
+		} else if (strcmp(&arg[2], "uring") == 0) {
+			arginfo->opts.engine = PINGFS_ENGINE_URING;
+		} else {
+			fprintf(stderr, "Bad engine given! Exiting\n");
+			print_usage(outargs->argv[0]);
+			exit(1);
+		}
+		return 0;
+	case KEY_RATE:
+		if (strcmp(&arg[2], "auto") == 0) {
+			arginfo->opts.auto_rate = 1;
+			return 0;
+		}
+		res = sscanf(arg, "-r%u", &arginfo->opts.pps);
+		if (res == 1 && arginfo->opts.pps > 0) {
+			return 0;
+		} else {
+			fprintf(stderr, "Bad packet rate given! Exiting\n");
+			print_usage(outargs->argv[0]);
+			exit(1);
+		}
+	case KEY_BYTERATE:
+		res = sscanf(arg, "-b%u", &arginfo->opts.bps);
+		if (res == 1 && arginfo->opts.bps >= CHUNK_SIZE) {
+			return 0;
+		} else {
+			fprintf(stderr, "Bad byte rate given! Exiting\n");
+			print_usage(outargs->argv[0]);
+			exit(1);
+		}
+	case KEY_MIN_HOSTS:
+		res = sscanf(arg, "-n%d", &arginfo->opts.min_hosts);
+		if (res == 1 && arginfo->opts.min_hosts > 0) {
+			return 0;
+		} else {
+			fprintf(stderr, "Bad host count given! Exiting\n");
+			print_usage(outargs->argv[0]);
+			exit(1);
+		}
+	case KEY_METRICS:
+		arginfo->opts.metrics = strdup(&arg[2]);
+		return 0;
+	case KEY_CACHE:
+		arginfo->opts.cachefile = strdup(&arg[2]);
+		return 0;
+	case KEY_SCHED:
+		if (sched_set_policy(&arg[2])) {
+			fprintf(stderr, "Bad placement policy given! Exiting\n");
+			print_usage(outargs->argv[0]);
+			exit(1);
+		}
+		arginfo->opts.sched = strdup(&arg[2]);
+		return 0;
 	}
 	return 1;
 }
 
 int main(int argc, char **argv)
 {
-	struct gaicb **list;
-	struct host *hosts = NULL;
-	struct host *h;
-	int hostnames;
-	int host_count;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 	struct arginfo arginfo;
 	struct stat mountdir;
 	int res;
 
 	memset(&arginfo, 0, sizeof(arginfo));
-	arginfo.timeout = DEFAULT_TIMEOUT_S;
 	if (fuse_opt_parse(&args, &arginfo, pingfs_opts, pingfs_opt_proc) == -1) {
 		fprintf(stderr, "Error parsing options!\n");
 		print_usage(argv[0]);
@@ -208,39 +231,12 @@ int main(int argc, char **argv)
 	}
 	free(arginfo.mountpoint);
 
-	hostnames = read_hostnames(arginfo.hostfile, &list);
-	free(arginfo.hostfile);
-	if (!hostnames) {
-		fprintf(stderr, "No hosts configured! Exiting\n");
-		return EXIT_FAILURE;
-	}
-
-	if (net_open_sockets()) {
-		fprintf(stderr, "No raw sockets opened. Got root?\n");
-		return EXIT_FAILURE;
-	}
-
-	host_count = resolve_names(list, hostnames, &hosts);
-	if (host_count < 0) {
+	if (setup_start(&arginfo.opts))
 		return EXIT_FAILURE;
-	}
-
-	host_count = host_evaluate(&hosts, host_count, arginfo.timeout);
-	if (!host_count) {
-		fprintf(stderr, "No host passed the test\n");
-		return EXIT_FAILURE;
-	}
-
-	chunk_set_timeout(arginfo.timeout);
-
-	host_use(hosts);
 
 	/* Always run FUSE in foreground */
 	fuse_opt_add_arg(&args, "-f");
 
-	/* Run FUSE single threaded */
-	fuse_opt_add_arg(&args, "-s");
-
 	/* Default permissions handling, allow all users
 	 * Directory is 775 so only root can use it anyway */
 	fuse_opt_add_arg(&args, "-odefault_permissions,allow_other");
@@ -249,15 +245,14 @@ int main(int argc, char **argv)
 	fuse_opt_add_arg(&args, "-odirect_io");
 
 	printf("Mounting filesystem\n");
-	fuse_main(args.argc, args.argv, &fs_ops, NULL);
+	fuse_main(args.argc, args.argv, &fs_fuse_ops, NULL);
 
 	/* Clean up */
 	fuse_opt_free_args(&args);
-	h = hosts;
-	while (h) {
-		struct host *host = h;
-		h = h->next;
-		free(host);
-	}
+	setup_stop();
+	free((void*) arginfo.opts.hostfile);
+	free((void*) arginfo.opts.cachefile);
+	free((void*) arginfo.opts.metrics);
+	free((void*) arginfo.opts.sched);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "ring.h"
+#include "icmp.h"
+#include "chunk.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+/* 64 blocks of 256kB, each holds a bit over 200 chunk sized packets */
+#define RING_BLOCK_SIZE (1 << 18)
+#define RING_BLOCK_NR 64
+#define RING_FRAME_SIZE 2048
+/* Hand over a block that is not full after this many ms */
+#define RING_BLOCK_TIMEOUT_MS 2
+
+static struct ring_data {
+	int fd;
+	uint8_t *map;
+	unsigned int cur;
+} ring;
+
+/* The packet socket sees all traffic on all interfaces, starting at
+ * the IP header. Only pass incoming ICMP and ICMPv6 echo replies
+ * small enough to carry a chunk. */
+static struct sock_filter ring_filter[] = {
+	/* 0: Drop our own outgoing packets */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 21, 0),
+	/* 2: Split on protocol */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 10),
+	/* 4: IPv4, must be ICMP */
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 17),
+	/* 6: X = IP header length, then check type and code */
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+	BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 14),
+	BPF_STMT(BPF_LD | BPF_B | BPF_IND, 1),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 12),
+	/* 11: ICMP length = IP total length - IP header length */
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2),
+	BPF_STMT(BPF_ALU | BPF_SUB | BPF_X, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, ICMP_HDRLEN + CHUNK_SIZE, 9, 10),
+	/* 14: IPv6, fixed header must be followed by ICMPv6 */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, 8),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 6),
+	/* 17: Check type and code */
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 40),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP6_ECHO_REPLY, 0, 4),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 41),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2),
+	/* 21: ICMPv6 length is the IPv6 payload length */
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, ICMP_HDRLEN + CHUNK_SIZE, 0, 1),
+	/* 23: Drop */
+	BPF_STMT(BPF_RET | BPF_K, 0),
+	/* 24: Accept */
+	BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+};
+
+int ring_open()
+{
+	struct tpacket_req3 req;
+	struct sock_fprog prog;
+	int version = TPACKET_V3;
+	size_t maplen = (size_t) RING_BLOCK_SIZE * RING_BLOCK_NR;
+
+	/* Datagram mode gives packets from the network header */
+	ring.fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
+	if (ring.fd < 0) {
+		perror("Failed to open packet socket");
+		return 1;
+	}
+
+	/* Attach filter before the ring, to not get unfiltered packets */
+	prog.len = sizeof(ring_filter) / sizeof(ring_filter[0]);
+	prog.filter = ring_filter;
+	if (setsockopt(ring.fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		perror("Failed to set BPF filter on packet socket");
+		goto err;
+	}
+
+	if (setsockopt(ring.fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("Failed to enable TPACKET_V3");
+		goto err;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RING_BLOCK_SIZE;
+	req.tp_block_nr = RING_BLOCK_NR;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCK_NR;
+	req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT_MS;
+	if (setsockopt(ring.fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		perror("Failed to set up packet ring");
+		goto err;
+	}
+
+	ring.map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, 0);
+	if (ring.map == MAP_FAILED) {
+		perror("Failed to map packet ring");
+		goto err;
+	}
+	ring.cur = 0;
+	return 0;
+err:
+	close(ring.fd);
+	ring.fd = -1;
+	return 1;
+}
+
+void ring_close()
+{
+	munmap(ring.map, (size_t) RING_BLOCK_SIZE * RING_BLOCK_NR);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+static void handle_frame(uint8_t *data, int len, net_recv_fn_t recv_fn, void *recv_data)
+{
+	struct icmp_packet pkt;
+	int res;
+
+	memset(&pkt.peer, 0, sizeof(pkt.peer));
+	if (len < 1)
+		return;
+
+	/* Get the peer address from the IP header */
+	if ((data[0] >> 4) == 4 && len >= 20) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) &pkt.peer;
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, &data[12], sizeof(sin->sin_addr));
+		pkt.peer_len = sizeof(*sin);
+	} else if ((data[0] >> 4) == 6 && len >= 40) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &pkt.peer;
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, &data[8], sizeof(sin6->sin6_addr));
+		pkt.peer_len = sizeof(*sin6);
+	} else {
+		return;
+	}
+
+	pkt.transport = ICMP_PACKET;
+	res = icmp_parse(&pkt, data, len);
+	if (res) {
+		net_count_parse_error(res);
+	} else if (pkt.type == ICMP_REPLY) {
+		recv_fn(recv_data, &pkt.peer, pkt.peer_len, pkt.id,
+			pkt.seqno, pkt.checksum, &pkt.payload, pkt.payload_len);
+	}
+}
+
+static struct tpacket_block_desc *get_block(unsigned int num)
+{
+	return (struct tpacket_block_desc *) (ring.map + (size_t) num * RING_BLOCK_SIZE);
+}
+
+/* Wait for the current block to be handed to us.
+ * Updates tv with the remaining time like select() */
+static int wait_block(struct timeval *tv)
+{
+	struct tpacket_block_desc *block = get_block(ring.cur);
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!(block->hdr.bh1.block_status & TP_STATUS_USER)) {
+		struct pollfd pfd;
+		int timeout = -1;
+		int res;
+
+		if (tv) {
+			struct timeval left = *tv;
+			net_tv_sub(&left, &start);
+			if (!left.tv_sec && !left.tv_usec) {
+				*tv = left;
+				return 0;
+			}
+			/* Round up to not spin on sub-ms timeouts */
+			timeout = left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+		}
+
+		pfd.fd = ring.fd;
+		pfd.events = POLLIN | POLLERR;
+		pfd.revents = 0;
+		res = poll(&pfd, 1, timeout);
+		if (res < 0)
+			return res;
+	}
+
+	if (tv)
+		net_tv_sub(tv, &start);
+	return 1;
+}
+
+int ring_recv(struct timeval *tv, net_recv_fn_t recv_fn, void *recv_data)
+{
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *frame;
+	struct tpacket_stats_v3 stats;
+	socklen_t statslen;
+	unsigned int num_pkts;
+	unsigned int i;
+	int res;
+
+	res = wait_block(tv);
+	if (res <= 0)
+		return res;
+
+	block = get_block(ring.cur);
+	num_pkts = block->hdr.bh1.num_pkts;
+	frame = (struct tpacket3_hdr *) ((uint8_t *) block +
+		block->hdr.bh1.offset_to_first_pkt);
+	for (i = 0; i < num_pkts; i++) {
+		handle_frame((uint8_t *) frame + frame->tp_net, frame->tp_snaplen,
+			recv_fn, recv_data);
+		frame = (struct tpacket3_hdr *) ((uint8_t *) frame + frame->tp_next_offset);
+	}
+
+	/* Give block back to kernel */
+	__sync_synchronize();
+	block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	ring.cur = (ring.cur + 1) % RING_BLOCK_NR;
+
+	/* Reading statistics resets them */
+	statslen = sizeof(stats);
+	if (getsockopt(ring.fd, SOL_PACKET, PACKET_STATISTICS, &stats, &statslen) == 0) {
+		uint32_t last = 0;
+		net_count_drops(stats.tp_drops, &last);
+	}
+
+	/* Timed out blocks can be empty, still report activity */
+	return num_pkts ? num_pkts : 1;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_RING_H_
+#define PINGFS_RING_H_
+
+#include "net.h"
+
+/* Receive echo replies from a memory mapped AF_PACKET ring (TPACKET_V3)
+ * instead of one recvfrom() call per packet. Needs root. */
+
+/* Returns 0 on success */
+int ring_open();
+void ring_close();
+
+/* Same semantics as net_recv(). Handles a full block of packets
+ * per call, the payloads are passed on in place from the ring. */
+int ring_recv(struct timeval *tv, net_recv_fn_t recv_fn, void *recv_data);
+
+#endif /* PINGFS_RING_H_ */
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "sched.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+/* Table size is a power of 2 with room for every host to get
+ * its minimum share, at least this */
+#define SCHED_MIN_SLOTS 4096
+#define SCHED_PERIOD_US 1000000
+/* Smallest share a usable host gets, relative to the average */
+#define SCHED_MIN_SHARE 0.05
+/* Readers step through the table by this share of its size, made
+ * odd so every slot is visited. Slots taken in a row then land far
+ * apart for any table size */
+#define SCHED_STRIDE 0.6180339887
+/* Slots tried to find a host with room */
+#define SCHED_TRIES 64
+
+/* Hosts repeated in proportion to their weight. Readers take the next
+ * slot with an atomic add, and the table is swapped when rebuilt */
+struct sched_table {
+	uint32_t size;
+	uint32_t stride;
+	struct sched_table *retired;
+	struct host *slots[];
+};
+
+static double rr_weight(struct host *h)
+{
+	return 1.0;
+}
+
+/* Favour hosts returning data quickly and reliably, and
+ * those with room left in their congestion window */
+static double weighted_weight(struct host *h);
+
+static const struct sched_policy policies[] = {
+	{ "rr", rr_weight },
+	{ "weighted", weighted_weight },
+	{ NULL, NULL },
+};
+
+static struct sched_data {
+	const struct sched_policy *policy;
+	struct host *hosts;
+	/* Double buffered, only the network thread rebuilds */
+	struct sched_table *tables[2];
+	struct sched_table *active;
+	uint32_t cursor;
+	struct host *fast;
+	struct host *slow;
+	unsigned rebuilds;
+	uint64_t last_rebuild;
+} sched = {
+	.policy = &policies[1],
+};
+
+int sched_set_policy(const char *name)
+{
+	const struct sched_policy *p;
+
+	for (p = policies; p->name; p++) {
+		if (strcmp(p->name, name) == 0) {
+			sched.policy = p;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static double weighted_weight(struct host *h)
+{
+	double rtt = h->srtt_us ? h->srtt_us : host_rto_us(h);
+	double reliability = 1.0 - h->loss;
+	double spare = 1.0;
+
+	if (h->cwnd > 0)
+		spare = MAX(0.1, (h->cwnd - h->chunks) / h->cwnd);
+	return reliability * reliability * spare / MAX(rtt, 1.0);
+}
+
+/* Give each host slots in proportion to its weight, carrying the
+ * rounding error over so small shares add up. The starting host is
+ * rotated so the same hosts do not always win the rounding. Each host
+ * gets a run of slots, readers spread them out with the stride */
+static void fill_table(struct sched_table *t, struct host **hosts,
+	double *weights, int count)
+{
+	double total = 0;
+	double acc = 0;
+	int filled = 0;
+	int i, n;
+
+	for (i = 0; i < count; i++)
+		total += weights[i];
+
+	for (n = 0; n < count && filled < t->size; n++) {
+		int want;
+		i = (n + sched.rebuilds) % count;
+		acc += weights[i] * t->size / total;
+		want = MIN((int) (acc + 0.5), (int) t->size);
+		while (filled < want) {
+			t->slots[filled] = hosts[i];
+			filled++;
+		}
+	}
+	/* Rounding left some slots */
+	for (; filled < t->size; filled++)
+		t->slots[filled] = hosts[0];
+	sched.rebuilds++;
+}
+
+/* Table to build next, grown if too small for count hosts. Readers
+ * may still use an old table, so grown out ones are kept. They add
+ * up to less than the current one */
+static struct sched_table *next_table(int count)
+{
+	int i = (sched.active == sched.tables[0]) ? 1 : 0;
+	struct sched_table *t = sched.tables[i];
+	uint32_t size = SCHED_MIN_SLOTS;
+
+	while (size < count / SCHED_MIN_SHARE)
+		size *= 2;
+	if (t && t->size >= size)
+		return t;
+	t = malloc(sizeof(*t) + size * sizeof(struct host *));
+	if (!t)
+		return sched.tables[i];
+	t->size = size;
+	t->stride = (uint32_t) (size * SCHED_STRIDE) | 1;
+	t->retired = sched.tables[i];
+	sched.tables[i] = t;
+	return t;
+}
+
+static void rebuild()
+{
+	struct sched_table *t;
+	struct host **hosts;
+	struct host *fast, *slow;
+	struct host *h;
+	double *weights;
+	double avg = 0;
+	int count = 0;
+	int used = 0;
+	int i;
+
+	for (h = sched.hosts; h; h = h->next)
+		count++;
+	if (!count)
+		return;
+
+	weights = calloc(count, sizeof(double));
+	hosts = calloc(count, sizeof(struct host *));
+	if (!weights || !hosts) {
+		free(weights);
+		free(hosts);
+		return;
+	}
+	fast = slow = NULL;
+	for (h = sched.hosts, i = 0; h; h = h->next) {
+		double w = 0;
+		if (h->state == HOST_OK)
+			w = sched.policy->weight(h);
+		if (w <= 0)
+			continue;
+		hosts[i] = h;
+		weights[i] = w;
+		avg += w;
+		used = ++i;
+		if (!h->srtt_us)
+			continue;
+		if (!fast || h->srtt_us < fast->srtt_us)
+			fast = h;
+		if (host_has_room(h) && (!slow || h->srtt_us > slow->srtt_us))
+			slow = h;
+	}
+	__atomic_store_n(&sched.fast, fast, __ATOMIC_RELAXED);
+	__atomic_store_n(&sched.slow, slow, __ATOMIC_RELAXED);
+	if (!used) {
+		/* Nothing usable, spread evenly over hosts in use */
+		for (h = sched.hosts; h; h = h->next) {
+			if (h->state == HOST_OK || h->state == HOST_QUARANTINED) {
+				hosts[used] = h;
+				weights[used++] = 1.0;
+			}
+		}
+		if (!used) {
+			free(weights);
+			free(hosts);
+			return;
+		}
+	} else {
+		avg /= used;
+		for (i = 0; i < used; i++)
+			weights[i] = MAX(weights[i], avg * SCHED_MIN_SHARE);
+	}
+
+	t = next_table(used);
+	if (t) {
+		fill_table(t, hosts, weights, used);
+		__atomic_store_n(&sched.active, t, __ATOMIC_RELEASE);
+	}
+	free(weights);
+	free(hosts);
+}
+
+void sched_init(struct host *hosts)
+{
+	sched.hosts = hosts;
+	sched.active = NULL;
+	rebuild();
+}
+
+void sched_tick(uint64_t now_us)
+{
+	if (now_us - sched.last_rebuild < SCHED_PERIOD_US)
+		return;
+	sched.last_rebuild = now_us;
+	rebuild();
+}
+
+void sched_update()
+{
+	rebuild();
+}
+
+struct host *sched_pick()
+{
+	struct sched_table *t = __atomic_load_n(&sched.active, __ATOMIC_ACQUIRE);
+	uint32_t idx;
+	int i;
+
+	if (!t)
+		return NULL;
+	for (i = 0; i < SCHED_TRIES; i++) {
+		struct host *h;
+		idx = __atomic_fetch_add(&sched.cursor, 1, __ATOMIC_RELAXED);
+		h = t->slots[(idx * t->stride) & (t->size - 1)];
+		if (host_has_room(h))
+			return h;
+	}
+	return NULL;
+}
+
+struct host *sched_fast_host()
+{
+	return __atomic_load_n(&sched.fast, __ATOMIC_RELAXED);
+}
+
+struct host *sched_slow_host()
+{
+	return __atomic_load_n(&sched.slow, __ATOMIC_RELAXED);
+}
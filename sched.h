@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_SCHED_H_
+#define PINGFS_SCHED_H_
+
+#include "host.h"
+
+#include <stdint.h>
+
+/* Placement policy, gives each host a share of new chunks */
+struct sched_policy {
+	const char *name;
+	/* Relative weight of host, 0 to not use it */
+	double (*weight)(struct host *h);
+};
+
+/* Select policy by name, returns nonzero if unknown */
+int sched_set_policy(const char *name);
+
+/* Start using hosts, builds the first placement table */
+void sched_init(struct host *hosts);
+
+/* Rebuild the table if it is time to. Call from the network thread */
+void sched_tick(uint64_t now_us);
+/* Rebuild the table now, after host state changed */
+void sched_update();
+
+/* Get host for a new chunk. Lock free, can be called
+ * from any thread. Skips hosts with full congestion windows,
+ * returns NULL if none with room was found */
+struct host *sched_pick();
+
+/* Usable hosts with the lowest RTT, and with the highest RTT
+ * among those with room for more chunks. Updated with the table */
+struct host *sched_fast_host();
+struct host *sched_slow_host();
+
+#endif /* PINGFS_SCHED_H_ */
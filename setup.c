@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "setup.h"
+#include "host.h"
+#include "net.h"
+#include "chunk.h"
+#include "pacer.h"
+#include "sched.h"
+#include "cache.h"
+#include "health.h"
+#include "aead.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define DEFAULT_TIMEOUT_S 1
+/* Hostnames resolved and evaluated at a time with min_hosts */
+#define ADMIT_BATCH 256
+
+static struct setup_data {
+	struct host *hosts;
+	/* Saved again at stop */
+	char *cachefile;
+} setup;
+
+/* Resolves remaining hostnames while running and hands
+ * the hosts to the health monitor for testing */
+static struct admit_data {
+	pthread_t thread;
+	struct gaicb **list;
+	int start;
+	int names;
+	int stop;
+} admit;
+
+static void *admit_thread(void *arg)
+{
+	int i;
+	int n;
+
+	for (i = admit.start; i < admit.names; i += n) {
+		if (__atomic_load_n(&admit.stop, __ATOMIC_RELAXED))
+			break;
+		n = MIN(ADMIT_BATCH, admit.names - i);
+		if (getaddrinfo_a(GAI_WAIT, &admit.list[i], n, NULL) == 0)
+			health_add_hosts(host_create(&admit.list[i], n));
+	}
+	return NULL;
+}
+
+static void admit_start(struct gaicb **list, int start, int names)
+{
+	admit.list = list;
+	admit.start = start;
+	admit.names = names;
+	admit.stop = 0;
+	if (pthread_create(&admit.thread, NULL, admit_thread, NULL)) {
+		perror("Failed to start host admission");
+		admit.list = NULL;
+		host_free_resolvlist(list, names);
+	}
+}
+
+static void admit_stop()
+{
+	if (!admit.list)
+		return;
+	__atomic_store_n(&admit.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(admit.thread, NULL);
+	host_free_resolvlist(admit.list, admit.names);
+	admit.list = NULL;
+}
+
+static void free_hosts(struct host *h)
+{
+	while (h) {
+		struct host *host = h;
+		h = h->next;
+		free(host);
+	}
+}
+
+/* Resolve and evaluate hostnames into setup.hosts. With min_hosts,
+ * stop when enough are good and admit the rest in the background.
+ * Returns the host count or a negative errno */
+static int resolve_hosts(const struct pingfs_options *opts, int timeout)
+{
+	struct gaicb **list;
+	struct host *h;
+	int hostnames;
+	int host_count = 0;
+	int batch;
+	int i;
+
+	hostnames = host_read_file(opts->hostfile, &list);
+	if (!hostnames) {
+		fprintf(stderr, "No hosts configured!\n");
+		return -ENOENT;
+	}
+
+	batch = opts->min_hosts ? ADMIT_BATCH : hostnames;
+	for (i = 0; i < hostnames; i += batch) {
+		struct host *new_hosts = NULL;
+		int n = MIN(batch, hostnames - i);
+		int count;
+
+		if (opts->min_hosts && host_count >= opts->min_hosts)
+			break;
+		count = host_resolve(&list[i], n, &new_hosts);
+		if (count <= 0)
+			continue;
+		count = host_evaluate(&new_hosts, count, timeout);
+		if (!count) {
+			free_hosts(new_hosts);
+			continue;
+		}
+		if (setup.hosts) {
+			for (h = setup.hosts; h->next; h = h->next)
+				;
+			h->next = new_hosts;
+		} else {
+			setup.hosts = new_hosts;
+		}
+		host_count += count;
+	}
+	if (!host_count) {
+		fprintf(stderr, "No host passed the test\n");
+		host_free_resolvlist(list, hostnames);
+		return -EHOSTUNREACH;
+	}
+	if (i < hostnames) {
+		printf("Adding remaining %d hostnames in background\n", hostnames - i);
+		admit_start(list, i, hostnames);
+	} else {
+		host_free_resolvlist(list, hostnames);
+	}
+	return host_count;
+}
+
+int setup_start(const struct pingfs_options *opts)
+{
+	int timeout = opts->timeout ? opts->timeout : DEFAULT_TIMEOUT_S;
+	int host_count = 0;
+	int res;
+
+	switch (opts->engine) {
+	case PINGFS_ENGINE_SELECT:
+		net_set_engine(NET_ENGINE_SELECT);
+		break;
+	case PINGFS_ENGINE_PACKET:
+		net_set_engine(NET_ENGINE_PACKET);
+		break;
+	case PINGFS_ENGINE_URING:
+		net_set_engine(NET_ENGINE_URING);
+		break;
+	default:
+		fprintf(stderr, "Bad engine given\n");
+		return -EINVAL;
+	}
+	if (opts->sched && sched_set_policy(opts->sched)) {
+		fprintf(stderr, "Bad placement policy given\n");
+		return -EINVAL;
+	}
+	net_set_raw_only(opts->raw_only);
+	pacer_set_rate(opts->pps, opts->bps);
+	if (opts->auto_rate)
+		pacer_set_auto();
+	if (opts->encrypt && aead_enable()) {
+		fprintf(stderr, "Encryption failed to start\n");
+		return -EIO;
+	}
+	if (net_open_sockets()) {
+		fprintf(stderr, "No ICMP sockets opened. Got root, "
+			"or a ping_group_range allowing ping sockets?\n");
+		res = -EACCES;
+		goto err_aead;
+	}
+
+	host_set_timeout(timeout);
+	if (opts->cachefile) {
+		host_count = cache_load(opts->cachefile, opts->hostfile, &setup.hosts);
+		if (host_count)
+			printf("Loaded %d hosts from cache, checking them in background\n",
+				host_count);
+	}
+	if (!host_count) {
+		res = resolve_hosts(opts, timeout);
+		if (res < 0)
+			goto err_hosts;
+		if (opts->cachefile)
+			cache_save(opts->cachefile, setup.hosts);
+	}
+	if (opts->cachefile) {
+		setup.cachefile = strdup(opts->cachefile);
+		if (!setup.cachefile) {
+			res = -ENOMEM;
+			goto err_admit;
+		}
+	}
+
+	chunk_set_timeout(timeout);
+	host_use(setup.hosts);
+	/* Start anyway, metrics are not needed for the data */
+	if (opts->metrics && !metrics_start(opts->metrics, setup.hosts))
+		printf("Serving metrics on %s\n", opts->metrics);
+	return 0;
+
+err_admit:
+	admit_stop();
+err_hosts:
+	free_hosts(setup.hosts);
+	setup.hosts = NULL;
+	net_close_sockets();
+err_aead:
+	aead_disable();
+	return res;
+}
+
+void setup_stop()
+{
+	metrics_stop();
+	admit_stop();
+	if (setup.cachefile) {
+		/* Save with estimates from this run */
+		cache_save(setup.cachefile, setup.hosts);
+		free(setup.cachefile);
+		setup.cachefile = NULL;
+	}
+	free_hosts(setup.hosts);
+	setup.hosts = NULL;
+	net_close_sockets();
+	aead_disable();
+}
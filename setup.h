@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_SETUP_H_
+#define PINGFS_SETUP_H_
+
+#include "libpingfs.h"
+
+/* Start-up shared by pingfs and libpingfs, before fs_start(). Opens
+ * sockets, loads or resolves and evaluates hosts, and starts metrics
+ * and host admission. Everything is undone on failure.
+ * Returns 0 or a negative errno */
+int setup_start(const struct pingfs_options *opts);
+/* Undo setup_start(), after fs_stop() */
+void setup_stop();
+
+#endif /* PINGFS_SETUP_H_ */
@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "sim.h"
+#include "host.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+/* Virtual clock starts like a machine up for a while */
+#define SIM_START_US 1000000000ULL
+
+/* In order of handling when at the same time */
+enum sim_event_type {
+	SIM_REPLY,
+	SIM_ARRIVE,
+	SIM_WAKE,
+};
+
+struct sim_sleeper {
+	int done;
+};
+
+struct sim_event {
+	uint64_t time;
+	enum sim_event_type type;
+	struct host *host;
+	struct sim_sleeper *sleeper;
+	uint16_t id;
+	uint16_t seqno;
+	size_t len;
+	uint8_t data[];
+};
+
+struct sim_host {
+	struct sim_model model;
+	uint32_t index;
+	uint64_t rng;
+	/* Rate limit token bucket */
+	double tokens;
+	uint64_t refill_us;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	/* Signalled when no driver runs */
+	pthread_cond_t idle;
+	/* Signalled when sleepers are woken */
+	pthread_cond_t wake;
+	int enabled;
+	uint64_t seed;
+	uint64_t now;
+	/* Driver threads running, time stands still until 0 */
+	int busy;
+	uint32_t hosts;
+	struct sim_model model;
+	/* Binary min-heap of pending events */
+	struct sim_event **heap;
+	size_t events;
+	size_t size;
+} sim = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.model = {
+		.rtt_us = 50000,
+		.jitter_us = 5000,
+	},
+};
+
+static __thread int driver;
+
+/* splitmix64 */
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double rng_uniform(uint64_t *state)
+{
+	return (rng_next(state) >> 11) * 0x1.0p-53;
+}
+
+/* Ties are broken by content, not by order of sending, so
+ * threads racing to send do not change the outcome */
+static int event_before(struct sim_event *a, struct sim_event *b)
+{
+	uint32_t ai, bi;
+
+	if (a->time != b->time)
+		return a->time < b->time;
+	if (a->type != b->type)
+		return a->type < b->type;
+	ai = a->host ? a->host->sim->index : 0;
+	bi = b->host ? b->host->sim->index : 0;
+	if (ai != bi)
+		return ai < bi;
+	if (a->id != b->id)
+		return a->id < b->id;
+	return a->seqno < b->seqno;
+}
+
+/* Must hold sim.mutex */
+static void push_event(struct sim_event *ev)
+{
+	size_t i;
+
+	if (sim.events == sim.size) {
+		size_t size = sim.size ? sim.size * 2 : 1024;
+		struct sim_event **heap = realloc(sim.heap, size * sizeof(*heap));
+		if (!heap) {
+			perror("Failed to grow simulator event queue");
+			free(ev);
+			return;
+		}
+		sim.heap = heap;
+		sim.size = size;
+	}
+	i = sim.events++;
+	while (i > 0 && event_before(ev, sim.heap[(i - 1) / 2])) {
+		sim.heap[i] = sim.heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	sim.heap[i] = ev;
+}
+
+/* Must hold sim.mutex */
+static struct sim_event *pop_event()
+{
+	struct sim_event *top = sim.heap[0];
+	struct sim_event *last = sim.heap[--sim.events];
+	size_t i = 0;
+
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= sim.events)
+			break;
+		if (child + 1 < sim.events && event_before(sim.heap[child + 1], sim.heap[child]))
+			child++;
+		if (!event_before(sim.heap[child], last))
+			break;
+		sim.heap[i] = sim.heap[child];
+		i = child;
+	}
+	if (sim.events)
+		sim.heap[i] = last;
+	return top;
+}
+
+void sim_enable(uint64_t seed)
+{
+	sim.enabled = 1;
+	sim.seed = seed;
+	sim.now = SIM_START_US;
+	net_set_engine(NET_ENGINE_SIM);
+}
+
+int sim_enabled()
+{
+	return sim.enabled;
+}
+
+void sim_set_default(const struct sim_model *m)
+{
+	pthread_mutex_lock(&sim.mutex);
+	sim.model = *m;
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+/* Must hold sim.mutex */
+static void add_host(struct host *h, const struct sim_model *m)
+{
+	struct sim_host *sh = calloc(1, sizeof(*sh));
+	uint64_t index;
+
+	if (!sh) {
+		perror("Failed to add simulated host");
+		abort();
+	}
+	sh->model = *m;
+	sh->index = sim.hosts++;
+	/* Own random stream for each host */
+	index = sh->index;
+	sh->rng = sim.seed ^ rng_next(&index);
+	sh->tokens = m->burst;
+	sh->refill_us = sim.now;
+	h->sim = sh;
+}
+
+void sim_add_host(struct host *h, const struct sim_model *m)
+{
+	pthread_mutex_lock(&sim.mutex);
+	free(h->sim);
+	add_host(h, m);
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+uint64_t sim_now_us()
+{
+	return __atomic_load_n(&sim.now, __ATOMIC_RELAXED);
+}
+
+void sim_enter()
+{
+	pthread_mutex_lock(&sim.mutex);
+	driver = 1;
+	sim.busy++;
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+/* Must hold sim.mutex */
+static void driver_blocks()
+{
+	if (--sim.busy == 0)
+		pthread_cond_signal(&sim.idle);
+}
+
+void sim_exit()
+{
+	pthread_mutex_lock(&sim.mutex);
+	driver = 0;
+	driver_blocks();
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+void sim_sleep(uint64_t us)
+{
+	struct sim_sleeper sleeper = { 0 };
+	struct sim_event *ev;
+
+	if (!driver)
+		return;
+	ev = calloc(1, sizeof(*ev));
+	if (!ev)
+		return;
+	pthread_mutex_lock(&sim.mutex);
+	ev->time = sim.now + us;
+	ev->type = SIM_WAKE;
+	ev->sleeper = &sleeper;
+	push_event(ev);
+	driver_blocks();
+	/* Counted as running again by the network thread */
+	while (!sleeper.done)
+		pthread_cond_wait(&sim.wake, &sim.mutex);
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+int sim_block()
+{
+	if (!driver)
+		return 0;
+	pthread_mutex_lock(&sim.mutex);
+	driver_blocks();
+	pthread_mutex_unlock(&sim.mutex);
+	return 1;
+}
+
+void sim_unblock()
+{
+	pthread_mutex_lock(&sim.mutex);
+	sim.busy++;
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+void sim_send(struct host *host, uint16_t id, uint16_t seqno, const uint8_t *data, size_t len)
+{
+	struct sim_event *ev = malloc(sizeof(*ev) + len);
+
+	if (!ev)
+		return;
+	pthread_mutex_lock(&sim.mutex);
+	if (!host->sim)
+		add_host(host, &sim.model);
+	/* Random parts are chosen on arrival, in event order */
+	ev->time = sim.now + host->sim->model.rtt_us / 2;
+	ev->type = SIM_ARRIVE;
+	ev->host = host;
+	ev->sleeper = NULL;
+	ev->id = id;
+	ev->seqno = seqno;
+	ev->len = len;
+	memcpy(ev->data, data, len);
+	push_event(ev);
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+/* Must hold sim.mutex. Request reaches host, it is dropped or answered */
+static void arrive(struct sim_event *ev)
+{
+	struct sim_host *sh = ev->host->sim;
+	struct sim_model *m = &sh->model;
+	uint64_t delay;
+
+	if (m->rate_pps) {
+		sh->tokens += (double) (sim.now - sh->refill_us) * m->rate_pps / 1e6;
+		sh->tokens = MIN(sh->tokens, MAX(m->burst, 1));
+		sh->refill_us = sim.now;
+		if (sh->tokens < 1) {
+			free(ev);
+			return;
+		}
+		sh->tokens -= 1;
+	}
+	/* One draw for each way */
+	if (rng_uniform(&sh->rng) < m->loss || rng_uniform(&sh->rng) < m->loss) {
+		free(ev);
+		return;
+	}
+	delay = m->rtt_us - m->rtt_us / 2;
+	if (m->jitter_us)
+		delay += (uint64_t) (-log(1 - rng_uniform(&sh->rng)) * m->jitter_us);
+	if (m->reorder && rng_uniform(&sh->rng) < m->reorder)
+		delay += m->reorder_us;
+	ev->time = sim.now + delay;
+	ev->type = SIM_REPLY;
+	push_event(ev);
+}
+
+static void unlock_sim(void *arg)
+{
+	pthread_mutex_unlock(&sim.mutex);
+}
+
+/* Must hold sim.mutex. Network thread waits here while drivers run */
+static void wait_idle()
+{
+	pthread_cleanup_push(unlock_sim, NULL);
+	while (sim.busy > 0)
+		pthread_cond_wait(&sim.idle, &sim.mutex);
+	pthread_cleanup_pop(0);
+}
+
+int sim_recv(struct timeval *tv, net_recv_fn_t recv_fn, void *recv_data)
+{
+	uint64_t limit;
+	int res = 0;
+
+	pthread_mutex_lock(&sim.mutex);
+	wait_idle();
+	limit = sim.now + tv->tv_sec * 1000000ULL + tv->tv_usec;
+	while (sim.events && sim.heap[0]->time <= limit) {
+		struct sim_event *ev = pop_event();
+
+		__atomic_store_n(&sim.now, MAX(sim.now, ev->time), __ATOMIC_RELAXED);
+		if (ev->type == SIM_ARRIVE) {
+			arrive(ev);
+		} else if (ev->type == SIM_WAKE) {
+			ev->sleeper->done = 1;
+			sim.busy++;
+			pthread_cond_broadcast(&sim.wake);
+			free(ev);
+			wait_idle();
+			/* Let timers run before going on */
+			limit = sim.now;
+			break;
+		} else {
+			uint8_t *data = ev->data;
+			struct host *h = ev->host;
+
+			pthread_mutex_unlock(&sim.mutex);
+			recv_fn(recv_data, &h->sockaddr, h->sockaddr_len, ev->id,
+				ev->seqno, 0, &data, ev->len);
+			free(ev);
+			pthread_mutex_lock(&sim.mutex);
+			wait_idle();
+			res = 1;
+			limit = sim.now;
+			break;
+		}
+	}
+	/* Nothing more happens until limit */
+	__atomic_store_n(&sim.now, MAX(sim.now, limit), __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sim.mutex);
+	tv->tv_sec = 0;
+	tv->tv_usec = 0;
+	return res;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_SIM_H_
+#define PINGFS_SIM_H_
+
+#include "net.h"
+
+#include <stdint.h>
+
+/* Discrete event network simulator, used as the NET_ENGINE_SIM engine.
+ * Echo hosts are models run in virtual time, and timer_now_us() returns
+ * the virtual clock. The network thread moves the clock to the next
+ * event, but only while all driver threads are blocked waiting for a
+ * chunk or in sim_sleep(). With one driver thread a run only depends
+ * on the seed. */
+
+struct sim_model {
+	/* Round trip time: fixed part, and mean of an exponential part */
+	uint32_t rtt_us;
+	uint32_t jitter_us;
+	/* Chance of losing a request or its reply */
+	double loss;
+	/* Chance of delaying a reply by reorder_us more */
+	double reorder;
+	uint32_t reorder_us;
+	/* Replies per second and burst, like an ICMP rate limit.
+	 * Requests over it are dropped. 0 for no limit */
+	uint32_t rate_pps;
+	uint32_t burst;
+};
+
+/* Use the simulator instead of sockets, with a seed for all random
+ * choices. Call before net_open_sockets() */
+void sim_enable(uint64_t seed);
+int sim_enabled();
+
+/* Model for hosts not given one with sim_add_host() */
+void sim_set_default(const struct sim_model *m);
+/* Add host to the simulated network. Hosts are numbered in the
+ * order they are added, which picks their random stream */
+void sim_add_host(struct host *h, const struct sim_model *m);
+
+uint64_t sim_now_us();
+
+/* Calling thread drives the simulation. Virtual time stands still
+ * while it runs, until it blocks or calls sim_exit() */
+void sim_enter();
+void sim_exit();
+/* Let virtual time pass for a driver thread */
+void sim_sleep(uint64_t us);
+
+/* For chunk waits: sim_block() before blocking, returns 1 if time
+ * may now pass. Whoever wakes the thread calls sim_unblock() then */
+int sim_block();
+void sim_unblock();
+
+/* Engine functions, called from net.c */
+void sim_send(struct host *host, uint16_t id, uint16_t seqno, const uint8_t *data, size_t len);
+int sim_recv(struct timeval *tv, net_recv_fn_t recv_fn, void *recv_data);
+
+#endif /* PINGFS_SIM_H_ */
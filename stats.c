@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHELINE 64
+
+/* One per thread, on its own cache lines so threads
+ * never write to the same line */
+struct stats_block {
+	uint64_t counters[STAT_COUNTERS];
+	struct stats_block *prev;
+	struct stats_block *next;
+} __attribute__((aligned(CACHELINE)));
+
+/* Blocks of running threads, and counts from exited ones.
+ * The lock is only taken when a thread starts or stops
+ * counting, and when reading */
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_block *blocks;
+static uint64_t retired[STAT_COUNTERS];
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static __thread struct stats_block *local;
+
+/* Thread exit, keep its counts and free the block */
+static void retire_block(void *arg)
+{
+	struct stats_block *b = arg;
+	int i;
+
+	pthread_mutex_lock(&blocks_lock);
+	for (i = 0; i < STAT_COUNTERS; i++)
+		retired[i] += b->counters[i];
+	if (b->prev)
+		b->prev->next = b->next;
+	else
+		blocks = b->next;
+	if (b->next)
+		b->next->prev = b->prev;
+	pthread_mutex_unlock(&blocks_lock);
+	local = NULL;
+	free(b);
+}
+
+static void create_key()
+{
+	pthread_key_create(&key, retire_block);
+}
+
+static struct stats_block *create_block()
+{
+	struct stats_block *b;
+
+	pthread_once(&key_once, create_key);
+	if (posix_memalign((void **) &b, CACHELINE, sizeof(*b)))
+		return NULL;
+	memset(b, 0, sizeof(*b));
+
+	pthread_mutex_lock(&blocks_lock);
+	b->next = blocks;
+	if (blocks)
+		blocks->prev = b;
+	blocks = b;
+	pthread_mutex_unlock(&blocks_lock);
+	pthread_setspecific(key, b);
+	return b;
+}
+
+void stats_add(enum stat_counter counter, uint64_t value)
+{
+	struct stats_block *b = local;
+
+	if (!b) {
+		b = create_block();
+		if (!b)
+			return;
+		local = b;
+	}
+	/* Only this thread writes here, the atomic store
+	 * just keeps readers from seeing torn values */
+	__atomic_store_n(&b->counters[counter], b->counters[counter] + value,
+		__ATOMIC_RELAXED);
+}
+
+void stats_get(uint64_t counters[STAT_COUNTERS])
+{
+	struct stats_block *b;
+	int i;
+
+	pthread_mutex_lock(&blocks_lock);
+	memcpy(counters, retired, sizeof(retired));
+	for (b = blocks; b; b = b->next) {
+		for (i = 0; i < STAT_COUNTERS; i++)
+			counters[i] += __atomic_load_n(&b->counters[i], __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&blocks_lock);
+}
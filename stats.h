@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_STATS_H_
+#define PINGFS_STATS_H_
+
+#include <stdint.h>
+
+enum stat_counter {
+	STAT_TX_PACKETS,
+	STAT_TX_BYTES,
+	STAT_RX_PACKETS,
+	STAT_RX_BYTES,
+	/* Packets dropped by the kernel before we could read them */
+	STAT_DROPS,
+	/* Received packets that were not valid ICMP echo */
+	STAT_PARSE_ERRORS,
+	STAT_CHECKSUM_ERRORS,
+	/* Reply for a known chunk with wrong seqno or length */
+	STAT_SEQNO_MISMATCH,
+	/* Reply payload did not match the chunk CRC */
+	STAT_PAYLOAD_ERRORS,
+	/* Packets the kernel refused to send */
+	STAT_SEND_ERRORS,
+	/* Chunks not back in time, then back late or given up on */
+	STAT_CHUNKS_OVERDUE,
+	STAT_CHUNKS_RECOVERED,
+	STAT_CHUNKS_LOST,
+	/* Chunks moved to another host by access heat */
+	STAT_CHUNKS_MIGRATED,
+	/* Reads of a chunk that timed out, or queued behind another */
+	STAT_WAIT_TIMEOUTS,
+	STAT_WAIT_BUSY,
+
+	STAT_COUNTERS,
+};
+
+/* Counters are kept per thread, so updating them needs no locks
+ * or atomic instructions. They are only summed when read. */
+void stats_add(enum stat_counter counter, uint64_t value);
+#define stats_inc(counter) stats_add((counter), 1)
+
+/* Get sum of each counter over all threads */
+void stats_get(uint64_t counters[STAT_COUNTERS]);
+
+#endif /* PINGFS_STATS_H_ */
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A reply that matches the CRC but fails to decrypt must fail the
+ * read with -EIO, and the chunk must go on circulating as it was */
+
+#include "host.h"
+#include "net.h"
+#include "chunk.h"
+#include "crc32c.h"
+#include "aead.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+static struct chunk *c;
+static uint8_t plain[CHUNK_SIZE];
+static int failures;
+
+static void *reader_thread(void *arg)
+{
+	uint8_t *data;
+	int *res = arg;
+
+	*res = chunk_wait_for(c, &data);
+	if (*res == CHUNK_SIZE) {
+		if (memcmp(data, plain, CHUNK_SIZE))
+			*res = -EINVAL;
+		chunk_release(c);
+	}
+	return NULL;
+}
+
+/* Send payload as the reply to a waiting reader, return its result */
+static int read_reply(const uint8_t *payload)
+{
+	struct sockaddr_storage addr;
+	uint8_t copy[CHUNK_SIZE];
+	uint8_t *data = copy;
+	pthread_t thread;
+	int res;
+
+	memset(&addr, 0, sizeof(addr));
+	memcpy(copy, payload, CHUNK_SIZE);
+	pthread_create(&thread, NULL, reader_thread, &res);
+	while (!__atomic_load_n(&c->io, __ATOMIC_ACQUIRE))
+		;
+	chunk_reply(NULL, &addr, sizeof(addr), c->id, c->seqno, 0, &data, CHUNK_SIZE);
+	pthread_join(thread, NULL);
+	return res;
+}
+
+static void check(const char *what, int ok)
+{
+	printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		failures++;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t before[STAT_COUNTERS];
+	uint64_t after[STAT_COUNTERS];
+	uint8_t sealed[CHUNK_SIZE];
+	struct sockaddr_in *sin;
+	struct host *h;
+	uint16_t seqno;
+	int i;
+
+	/* Replies are resent if sockets can be opened */
+	net_open_sockets();
+	host_set_timeout(1);
+	chunk_set_timeout(1);
+	if (aead_enable()) {
+		printf("Encryption not available\n");
+		return EXIT_FAILURE;
+	}
+	h = calloc(1, sizeof(*h));
+	sin = (struct sockaddr_in *) &h->sockaddr;
+	sin->sin_family = AF_INET;
+	inet_pton(AF_INET, "127.0.0.1", &sin->sin_addr);
+	h->sockaddr_len = sizeof(*sin);
+
+	for (i = 0; i < CHUNK_SIZE; i++)
+		plain[i] = i * 7;
+	c = chunk_create();
+	c->len = CHUNK_SIZE;
+	c->host = h;
+	chunk_add(c);
+	/* Sealed like chunk_send() does */
+	memcpy(sealed, plain, CHUNK_SIZE);
+	c->nonce = aead_seal(sealed, CHUNK_SIZE, c->tag);
+	c->crc = crc32c(0, sealed, CHUNK_SIZE);
+
+	seqno = c->seqno;
+	check("good reply is read", read_reply(sealed) == CHUNK_SIZE);
+	check("good reply is passed on", c->seqno == (uint16_t) (seqno + 1));
+
+	/* Corrupted, with a CRC to match */
+	sealed[100] ^= 1;
+	c->crc = crc32c(0, sealed, CHUNK_SIZE);
+	stats_get(before);
+	seqno = c->seqno;
+	check("tampered reply fails the read", read_reply(sealed) == -EIO);
+	stats_get(after);
+	check("tampered reply is counted",
+		after[STAT_PAYLOAD_ERRORS] == before[STAT_PAYLOAD_ERRORS] + 1);
+	check("tampered reply is passed on", c->seqno == (uint16_t) (seqno + 1));
+	check("chunk is not lost", !(c->flags & CHUNK_LOST) && !c->io);
+
+	/* The same copy comes back, the chunk is still there */
+	check("next pass fails the read again", read_reply(sealed) == -EIO);
+
+	chunk_remove(c);
+	chunk_free(c);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
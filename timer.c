@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "timer.h"
+#include "sim.h"
+
+#include <stddef.h>
+#include <time.h>
+
+#define US_PER_TICK 1000
+
+/* Ticks covered by levels below level n */
+#define LEVEL_SHIFT(n) (TIMER_L0_BITS + ((n) - 1) * TIMER_LN_BITS)
+/* Furthest time in the future a timer can be put, later
+ * timers are put in the last slot and moved again */
+#define MAX_DELTA ((1ULL << LEVEL_SHIFT(TIMER_LEVELS)) - 1)
+
+uint64_t timer_now_us()
+{
+	struct timespec ts;
+
+	if (sim_enabled())
+		return sim_now_us();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now_us)
+{
+	int i, j;
+
+	w->now = now_us / US_PER_TICK;
+	w->pending = 0;
+	for (i = 0; i < TIMER_L0_SIZE; i++)
+		w->l0[i] = NULL;
+	for (i = 0; i < TIMER_LEVELS - 1; i++)
+		for (j = 0; j < TIMER_LN_SIZE; j++)
+			w->ln[i][j] = NULL;
+}
+
+void timer_init(struct timer *t, timer_fn_t fn)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+	t->fn = fn;
+}
+
+int timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+static void link_timer(struct timer **slot, struct timer *t)
+{
+	t->next = *slot;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void unlink_timer(struct timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+static void place(struct timer_wheel *w, struct timer *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta;
+	int level;
+
+	if (expires < w->now)
+		expires = w->now;
+	delta = expires - w->now;
+	if (delta > MAX_DELTA) {
+		delta = MAX_DELTA;
+		expires = w->now + delta;
+	}
+
+	if (delta < TIMER_L0_SIZE) {
+		link_timer(&w->l0[expires & (TIMER_L0_SIZE - 1)], t);
+		return;
+	}
+	for (level = 1; level < TIMER_LEVELS - 1; level++) {
+		if (delta < (1ULL << LEVEL_SHIFT(level + 1)))
+			break;
+	}
+	link_timer(&w->ln[level - 1][(expires >> LEVEL_SHIFT(level)) & (TIMER_LN_SIZE - 1)], t);
+}
+
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires_us)
+{
+	if (timer_pending(t))
+		unlink_timer(t);
+	else
+		w->pending++;
+	t->expires = expires_us / US_PER_TICK;
+	place(w, t);
+}
+
+void timer_del(struct timer_wheel *w, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+	unlink_timer(t);
+	w->pending--;
+}
+
+/* Move timers in a slot of a higher level down */
+static void cascade(struct timer_wheel *w, int level)
+{
+	unsigned idx = (w->now >> LEVEL_SHIFT(level)) & (TIMER_LN_SIZE - 1);
+	struct timer *t = w->ln[level - 1][idx];
+
+	w->ln[level - 1][idx] = NULL;
+	while (t) {
+		struct timer *next = t->next;
+		t->next = NULL;
+		t->pprev = NULL;
+		place(w, t);
+		t = next;
+	}
+}
+
+void timer_run(struct timer_wheel *w, uint64_t now_us)
+{
+	uint64_t now = now_us / US_PER_TICK;
+
+	while (w->now <= now) {
+		unsigned idx = w->now & (TIMER_L0_SIZE - 1);
+		int level;
+
+		if (!w->pending) {
+			w->now = now + 1;
+			break;
+		}
+
+		/* At start of a new round, refill from the level above */
+		for (level = 1; level < TIMER_LEVELS && !idx; level++) {
+			cascade(w, level);
+			if ((w->now >> LEVEL_SHIFT(level)) & (TIMER_LN_SIZE - 1))
+				break;
+		}
+
+		while (w->l0[idx]) {
+			struct timer *t = w->l0[idx];
+			unlink_timer(t);
+			w->pending--;
+			t->fn(t);
+		}
+		w->now++;
+	}
+}
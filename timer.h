@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_TIMER_H_
+#define PINGFS_TIMER_H_
+
+#include <stdint.h>
+
+/* Hierarchical timer wheel with 1 ms ticks. Adding, removing
+ * and expiring a timer is O(1). Not thread safe, the user
+ * must serialize all calls for a wheel. */
+
+#define TIMER_L0_BITS 8
+#define TIMER_LN_BITS 6
+#define TIMER_L0_SIZE (1 << TIMER_L0_BITS)
+#define TIMER_LN_SIZE (1 << TIMER_LN_BITS)
+#define TIMER_LEVELS 3
+
+struct timer;
+
+typedef void (*timer_fn_t)(struct timer *t);
+
+struct timer {
+	struct timer *next;
+	struct timer **pprev;
+	/* Expiry time in ticks (ms) */
+	uint64_t expires;
+	timer_fn_t fn;
+};
+
+struct timer_wheel {
+	/* Next tick to process */
+	uint64_t now;
+	unsigned pending;
+	struct timer *l0[TIMER_L0_SIZE];
+	struct timer *ln[TIMER_LEVELS - 1][TIMER_LN_SIZE];
+};
+
+/* Monotonic time in microseconds */
+uint64_t timer_now_us();
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now_us);
+
+void timer_init(struct timer *t, timer_fn_t fn);
+/* Arm timer to expire at time given in us, rearming if already armed */
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires_us);
+void timer_del(struct timer_wheel *w, struct timer *t);
+int timer_pending(const struct timer *t);
+
+/* Call fn of all timers expiring up to now_us. The callback
+ * may add or delete timers */
+void timer_run(struct timer_wheel *w, uint64_t now_us);
+
+#endif /* PINGFS_TIMER_H_ */
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "trace.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Events kept per thread, 1 MB each */
+#define RING_EVENTS (1 << 16)
+#define RING_MASK (RING_EVENTS - 1)
+
+struct trace_entry {
+	uint64_t ns;
+	uint32_t arg;
+	uint32_t event;
+};
+
+struct trace_ring {
+	struct trace_entry entries[RING_EVENTS];
+	/* Events written, only the owner thread writes it */
+	uint64_t head;
+	long tid;
+	struct trace_ring *prev;
+	struct trace_ring *next;
+};
+
+int trace_on;
+
+/* Events before this are from an earlier run */
+static uint64_t start_ns;
+
+/* Rings of running threads. Exited threads free theirs,
+ * with its events */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static __thread struct trace_ring *local;
+
+static const struct {
+	const char *name;
+	/* Chrome trace phase: Begin, End or instant */
+	char phase;
+} events[TRACE_EVENTS] = {
+	[TRACE_SEND] = { "send", 'i' },
+	[TRACE_RECV] = { "recv", 'i' },
+	[TRACE_PARSE_FAIL] = { "parse_fail", 'i' },
+	[TRACE_LOCK_BEGIN] = { "chunk_mutex", 'B' },
+	[TRACE_LOCK_END] = { "chunk_mutex", 'E' },
+	[TRACE_WAIT_BEGIN] = { "wait", 'B' },
+	[TRACE_WAIT_END] = { "wait", 'E' },
+	[TRACE_HANDOFF_BEGIN] = { "handoff", 'B' },
+	[TRACE_HANDOFF_END] = { "handoff", 'E' },
+	[TRACE_OP_BEGIN] = { NULL, 'B' },
+	[TRACE_OP_END] = { NULL, 'E' },
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void free_ring(void *arg)
+{
+	struct trace_ring *r = arg;
+
+	pthread_mutex_lock(&rings_lock);
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		rings = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	pthread_mutex_unlock(&rings_lock);
+	local = NULL;
+	free(r);
+}
+
+static void create_key()
+{
+	pthread_key_create(&key, free_ring);
+}
+
+static struct trace_ring *create_ring()
+{
+	struct trace_ring *r;
+
+	pthread_once(&key_once, create_key);
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&rings_lock);
+	r->next = rings;
+	if (rings)
+		rings->prev = r;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+	pthread_setspecific(key, r);
+	return r;
+}
+
+void trace_record(enum trace_event event, uint32_t arg)
+{
+	struct trace_ring *r = local;
+	struct trace_entry *e;
+
+	if (!r) {
+		r = create_ring();
+		if (!r)
+			return;
+		local = r;
+	}
+	e = &r->entries[r->head & RING_MASK];
+	e->ns = now_ns();
+	e->arg = arg;
+	e->event = event;
+	/* Entry is written before readers can see it */
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_enable(int on)
+{
+	if (on)
+		__atomic_store_n(&start_ns, now_ns(), __ATOMIC_RELAXED);
+	__atomic_store_n(&trace_on, on, __ATOMIC_RELAXED);
+}
+
+static void dump_ring(FILE *f, struct trace_ring *r, int *first)
+{
+	struct trace_entry *copy;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t i;
+	uint64_t since = __atomic_load_n(&start_ns, __ATOMIC_RELAXED);
+
+	copy = malloc(sizeof(r->entries));
+	if (!copy)
+		return;
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	tail = head > RING_EVENTS ? head - RING_EVENTS : 0;
+	for (i = tail; i < head; i++)
+		copy[i & RING_MASK] = r->entries[i & RING_MASK];
+	/* Drop entries the owner overwrote while copying */
+	i = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (i > RING_EVENTS && i - RING_EVENTS > tail)
+		tail = i - RING_EVENTS;
+
+	for (i = tail; i < head; i++) {
+		struct trace_entry *e = &copy[i & RING_MASK];
+		const char *name = events[e->event].name;
+
+		if (e->ns < since)
+			continue;
+		if (!name)
+			name = metrics_hist_name(e->arg);
+		fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,"
+			"\"pid\":%d,\"tid\":%ld", *first ? "" : ",\n", name,
+			events[e->event].phase, (unsigned long long) (e->ns / 1000),
+			(unsigned) (e->ns % 1000), (int) getpid(), r->tid);
+		if (events[e->event].phase == 'i')
+			fprintf(f, ",\"s\":\"t\"");
+		if (e->event == TRACE_SEND || e->event == TRACE_RECV)
+			fprintf(f, ",\"args\":{\"id\":%u,\"seqno\":%u}",
+				e->arg >> 16, e->arg & 0xffff);
+		else if (e->event != TRACE_OP_BEGIN && e->event != TRACE_OP_END)
+			fprintf(f, ",\"args\":{\"arg\":%u}", e->arg);
+		fprintf(f, "}");
+		*first = 0;
+	}
+	free(copy);
+}
+
+void trace_dump(FILE *f)
+{
+	struct trace_ring *r;
+	int first = 1;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	pthread_mutex_lock(&rings_lock);
+	for (r = rings; r; r = r->next)
+		dump_ring(f, r, &first);
+	pthread_mutex_unlock(&rings_lock);
+	fprintf(f, "\n]}\n");
+}
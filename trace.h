@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef PINGFS_TRACE_H_
+#define PINGFS_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum trace_event {
+	/* Packet sent or reply taken by chunk code, arg is id << 16 | seqno */
+	TRACE_SEND,
+	TRACE_RECV,
+	/* Received packet not valid, arg is parse result */
+	TRACE_PARSE_FAIL,
+	/* Waiting to get chunk_mutex */
+	TRACE_LOCK_BEGIN,
+	TRACE_LOCK_END,
+	/* Reader waiting for a chunk, arg is chunk id */
+	TRACE_WAIT_BEGIN,
+	TRACE_WAIT_END,
+	/* Network thread waiting while the reader has the chunk */
+	TRACE_HANDOFF_BEGIN,
+	TRACE_HANDOFF_END,
+	/* Filesystem operation, arg is its metric_hist */
+	TRACE_OP_BEGIN,
+	TRACE_OP_END,
+
+	TRACE_EVENTS,
+};
+
+extern int trace_on;
+
+/* Events go to a ring per thread, so recording takes no locks.
+ * When tracing is off only the flag is checked */
+#define TRACE(event, arg) do { \
+		if (__builtin_expect(__atomic_load_n(&trace_on, __ATOMIC_RELAXED), 0)) \
+			trace_record((event), (arg)); \
+	} while (0)
+
+void trace_record(enum trace_event event, uint32_t arg);
+
+/* Start or stop recording. Starting forgets earlier events */
+void trace_enable(int on);
+
+/* Write recorded events as Chrome trace JSON, which can be
+ * opened in Perfetto or chrome://tracing */
+void trace_dump(FILE *f);
+
+#endif /* PINGFS_TRACE_H_ */
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "uring.h"
+#include "chunk.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024
+/* Receive buffers, must be a power of 2 */
+#define URING_BUFS 1024
+#define URING_BUF_SIZE 2048
+#define URING_BGID 1
+#define URING_SEND_SLOTS 1024
+
+/* Type of operation in upper half of user_data */
+#define UD_RECV (1ULL << 32)
+#define UD_SEND (2ULL << 32)
+#define UD_TYPE(ud) ((ud) & ~0xFFFFFFFFULL)
+#define UD_INDEX(ud) ((ud) & 0xFFFFFFFFULL)
+
+struct send_slot {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage peer;
+	uint8_t data[ICMP_MAX_HDRLEN + CHUNK_SIZE];
+	int next_free;
+};
+
+struct recv_sock {
+	int fd;
+	enum icmp_transport transport;
+	int armed;
+	uint32_t drops;
+};
+
+static struct uring_data {
+	int fd;
+	/* Submission queue, protected by lock */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;
+	unsigned pending;
+	/* Completion queue, only used by the receiving thread */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings, for uring_close() */
+	uint8_t *sq_ring;
+	size_t sq_len;
+	uint8_t *cq_ring;
+	size_t cq_len;
+	size_t sqes_len;
+	/* Provided receive buffers */
+	struct io_uring_buf_ring *buf_ring;
+	uint8_t *bufs;
+	unsigned buf_tail;
+	/* Template for multishot recvmsg, sets space for address */
+	struct msghdr recv_msg;
+	struct recv_sock socks[2];
+	/* Send buffers, protected by lock */
+	struct send_slot *slots;
+	int free_slot;
+	pthread_mutex_t lock;
+} uring;
+
+/* Set while handling replies, so sends are batched */
+static __thread int in_recv;
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+	void *arg, size_t argsz)
+{
+	int res = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete,
+		flags, arg, argsz);
+	if (res < 0)
+		return -errno;
+	return res;
+}
+
+/* Get next free SQE, must hold lock. Published with publish_sqe() */
+static struct io_uring_sqe *get_sqe()
+{
+	unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (uring.sqe_tail - head >= uring.sq_entries)
+		return NULL;
+
+	sqe = &uring.sqes[uring.sqe_tail & uring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void publish_sqe()
+{
+	uring.sqe_tail++;
+	uring.pending++;
+	__atomic_store_n(uring.sq_tail, uring.sqe_tail, __ATOMIC_RELEASE);
+}
+
+/* Submit pending SQEs without waiting, must hold lock */
+static void submit_locked()
+{
+	int res;
+
+	if (!uring.pending)
+		return;
+	res = sys_enter(uring.pending, 0, 0, NULL, 0);
+	if (res > 0)
+		uring.pending -= res;
+}
+
+/* Submit pending SQEs and wait for at least one completion */
+static int submit_and_wait(struct timeval *tv)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned to_submit;
+	int res;
+
+	pthread_mutex_lock(&uring.lock);
+	to_submit = uring.pending;
+	uring.pending = 0;
+	pthread_mutex_unlock(&uring.lock);
+
+	memset(&arg, 0, sizeof(arg));
+	if (tv) {
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		arg.ts = (uintptr_t) &ts;
+	}
+	res = sys_enter(to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		&arg, sizeof(arg));
+
+	if (res < (int) to_submit) {
+		/* Put back what was not submitted */
+		pthread_mutex_lock(&uring.lock);
+		uring.pending += to_submit - (res > 0 ? res : 0);
+		pthread_mutex_unlock(&uring.lock);
+	}
+	return res;
+}
+
+/* Must hold lock */
+static void arm_recv(int idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = uring.socks[idx].fd;
+	sqe->addr = (uintptr_t) &uring.recv_msg;
+	sqe->len = 1;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = UD_RECV | idx;
+	publish_sqe();
+	uring.socks[idx].armed = 1;
+}
+
+static void add_buf(unsigned bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &uring.buf_ring->bufs[uring.buf_tail & (URING_BUFS - 1)];
+	buf->addr = (uintptr_t) &uring.bufs[(size_t) bid * URING_BUF_SIZE];
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	uring.buf_tail++;
+}
+
+static void publish_bufs()
+{
+	__atomic_store_n(&uring.buf_ring->tail, (uint16_t) uring.buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Kernels before 6.0 fail multishot recvmsg at once with -EINVAL,
+ * a working one has not completed yet. Only peeks at the CQ */
+static int multishot_ok()
+{
+	unsigned head = *uring.cq_head;
+	unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+		if (UD_TYPE(cqe->user_data) == UD_RECV && cqe->res == -EINVAL)
+			return 0;
+	}
+	return 1;
+}
+
+static void *map_ring(size_t len, off_t offset)
+{
+	return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		uring.fd, offset);
+}
+
+int uring_open(int fdv4, enum icmp_transport transport_v4,
+	int fdv6, enum icmp_transport transport_v6)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	size_t sq_len;
+	size_t cq_len;
+	uint8_t *sq_ring;
+	uint8_t *cq_ring;
+	int i;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_ENTRIES * 4;
+	uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (uring.fd < 0) {
+		perror("Failed to set up io_uring");
+		return 1;
+	}
+	if (!(params.features & IORING_FEAT_EXT_ARG) ||
+		!(params.features & IORING_FEAT_NODROP)) {
+		fprintf(stderr, "Kernel io_uring is too old\n");
+		goto err;
+	}
+
+	sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_len > sq_len)
+			sq_len = cq_len;
+		sq_ring = map_ring(sq_len, IORING_OFF_SQ_RING);
+		cq_ring = sq_ring;
+	} else {
+		sq_ring = map_ring(sq_len, IORING_OFF_SQ_RING);
+		cq_ring = map_ring(cq_len, IORING_OFF_CQ_RING);
+	}
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED) {
+		perror("Failed to map io_uring");
+		goto err;
+	}
+	uring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes = map_ring(uring.sqes_len, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED) {
+		perror("Failed to map io_uring");
+		goto err;
+	}
+	uring.sq_ring = sq_ring;
+	uring.sq_len = sq_len;
+	uring.cq_ring = cq_ring;
+	uring.cq_len = cq_len;
+
+	uring.sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+	uring.sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+	uring.sq_mask = *(unsigned *) (sq_ring + params.sq_off.ring_mask);
+	uring.sq_entries = params.sq_entries;
+	uring.sqe_tail = *uring.sq_tail;
+	/* SQEs are always used in order */
+	for (i = 0; i < params.sq_entries; i++)
+		((unsigned *) (sq_ring + params.sq_off.array))[i] = i;
+
+	uring.cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+	uring.cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+	uring.cq_mask = *(unsigned *) (cq_ring + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+	/* Register ring of receive buffers */
+	uring.buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	uring.bufs = malloc((size_t) URING_BUFS * URING_BUF_SIZE);
+	uring.slots = calloc(URING_SEND_SLOTS, sizeof(struct send_slot));
+	if (uring.buf_ring == MAP_FAILED || !uring.bufs || !uring.slots) {
+		perror("Failed to allocate io_uring buffers");
+		goto err;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) uring.buf_ring;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		perror("Failed to register io_uring buffers");
+		goto err;
+	}
+	uring.buf_tail = 0;
+	for (i = 0; i < URING_BUFS; i++)
+		add_buf(i);
+	publish_bufs();
+
+	for (i = 0; i < URING_SEND_SLOTS; i++)
+		uring.slots[i].next_free = i + 1;
+	uring.slots[URING_SEND_SLOTS - 1].next_free = -1;
+	uring.free_slot = 0;
+
+	if (pthread_mutex_init(&uring.lock, NULL)) {
+		perror("Failed to create a mutex");
+		goto err;
+	}
+
+	/* Received buffers start with io_uring_recvmsg_out, then the peer
+	 * address in as much space as msg_namelen, then the packet */
+	memset(&uring.recv_msg, 0, sizeof(uring.recv_msg));
+	uring.recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+	/* For SO_RXQ_OVFL drop count */
+	uring.recv_msg.msg_controllen = CMSG_SPACE(sizeof(uint32_t));
+
+	uring.socks[0].fd = fdv4;
+	uring.socks[0].transport = transport_v4;
+	uring.socks[1].fd = fdv6;
+	uring.socks[1].transport = transport_v6;
+	pthread_mutex_lock(&uring.lock);
+	for (i = 0; i < 2; i++) {
+		if (uring.socks[i].fd >= 0)
+			arm_recv(i);
+	}
+	submit_locked();
+	pthread_mutex_unlock(&uring.lock);
+	if (!multishot_ok()) {
+		fprintf(stderr, "Kernel io_uring has no multishot recvmsg\n");
+		goto err;
+	}
+	return 0;
+err:
+	close(uring.fd);
+	uring.fd = -1;
+	return 1;
+}
+
+void uring_close()
+{
+	close(uring.fd);
+	uring.fd = -1;
+	pthread_mutex_destroy(&uring.lock);
+	munmap(uring.buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+	free(uring.bufs);
+	free(uring.slots);
+	munmap(uring.sqes, uring.sqes_len);
+	if (uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_len);
+	munmap(uring.sq_ring, uring.sq_len);
+}
+
+int uring_send(int fd, struct icmp_packet *pkt)
+{
+	struct io_uring_sqe *sqe;
+	struct send_slot *slot;
+	int slotnum;
+	int hdrlen;
+
+	pthread_mutex_lock(&uring.lock);
+	slotnum = uring.free_slot;
+	sqe = get_sqe();
+	if (slotnum < 0 || !sqe) {
+		/* Everything in flight, send it directly */
+		pthread_mutex_unlock(&uring.lock);
+		return icmp_send(fd, pkt);
+	}
+	slot = &uring.slots[slotnum];
+	uring.free_slot = slot->next_free;
+
+	hdrlen = icmp_encode(pkt, slot->data);
+	memcpy(&slot->data[hdrlen], pkt->payload, pkt->payload_len);
+	memcpy(&slot->peer, &pkt->peer, pkt->peer_len);
+	slot->iov.iov_base = slot->data;
+	slot->iov.iov_len = hdrlen + pkt->payload_len;
+	memset(&slot->msg, 0, sizeof(slot->msg));
+	slot->msg.msg_name = &slot->peer;
+	slot->msg.msg_namelen = pkt->peer_len;
+	slot->msg.msg_iov = &slot->iov;
+	slot->msg.msg_iovlen = 1;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) &slot->msg;
+	sqe->len = 1;
+	sqe->user_data = UD_SEND | slotnum;
+	publish_sqe();
+
+	/* Sends from reply handling go out together after the batch */
+	if (!in_recv)
+		submit_locked();
+	pthread_mutex_unlock(&uring.lock);
+	return slot->iov.iov_len;
+}
+
+static void handle_recv(struct io_uring_cqe *cqe, net_recv_fn_t recv_fn, void *recv_data)
+{
+	struct io_uring_recvmsg_out *out;
+	struct recv_sock *sock;
+	struct icmp_packet pkt;
+	unsigned bid;
+	uint8_t *buf;
+	uint8_t *data;
+	size_t hdrlen;
+	int res;
+
+	sock = &uring.socks[UD_INDEX(cqe->user_data)];
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		/* Multishot ended, for example when out of buffers */
+		sock->armed = 0;
+	}
+	if (cqe->res < 0) {
+		if (cqe->res != -ENOBUFS)
+			fprintf(stderr, "io_uring receive failed: %s\n", strerror(-cqe->res));
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = &uring.bufs[(size_t) bid * URING_BUF_SIZE];
+	out = (struct io_uring_recvmsg_out *) buf;
+	hdrlen = sizeof(*out) + uring.recv_msg.msg_namelen + uring.recv_msg.msg_controllen;
+	data = buf + hdrlen;
+
+	if (cqe->res >= hdrlen && !(out->flags & MSG_TRUNC) &&
+		out->namelen <= uring.recv_msg.msg_namelen) {
+
+		memcpy(&pkt.peer, buf + sizeof(*out), out->namelen);
+		pkt.peer_len = out->namelen;
+		pkt.transport = sock->transport;
+		if (out->controllen) {
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = buf + sizeof(*out) + uring.recv_msg.msg_namelen;
+			msg.msg_controllen = out->controllen;
+			net_check_drops(&msg, &sock->drops);
+		}
+		res = icmp_parse(&pkt, data, out->payloadlen);
+		if (res) {
+			net_count_parse_error(res);
+		} else if (pkt.type == ICMP_REPLY) {
+			recv_fn(recv_data, &pkt.peer, pkt.peer_len, pkt.id,
+				pkt.seqno, pkt.checksum, &pkt.payload, pkt.payload_len);
+		}
+	}
+	add_buf(bid);
+}
+
+static void handle_send(struct io_uring_cqe *cqe)
+{
+	int slotnum = UD_INDEX(cqe->user_data);
+
+	if (cqe->res < 0) {
+		/* Seen by the auto pacer, like failed sends in net.c */
+		stats_inc(STAT_SEND_ERRORS);
+		errno = -cqe->res;
+		perror("Failed sending data packet");
+	}
+	pthread_mutex_lock(&uring.lock);
+	uring.slots[slotnum].next_free = uring.free_slot;
+	uring.free_slot = slotnum;
+	pthread_mutex_unlock(&uring.lock);
+}
+
+/* Handle all available completions, returns number handled */
+static int reap(net_recv_fn_t recv_fn, void *recv_data)
+{
+	unsigned head = *uring.cq_head;
+	unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	int count = 0;
+	int i;
+
+	in_recv = 1;
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+		if (UD_TYPE(cqe->user_data) == UD_RECV)
+			handle_recv(cqe, recv_fn, recv_data);
+		else if (UD_TYPE(cqe->user_data) == UD_SEND)
+			handle_send(cqe);
+		head++;
+		count++;
+		if (head == tail)
+			tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	}
+	in_recv = 0;
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+	if (count) {
+		publish_bufs();
+		pthread_mutex_lock(&uring.lock);
+		for (i = 0; i < 2; i++) {
+			if (uring.socks[i].fd >= 0 && !uring.socks[i].armed)
+				arm_recv(i);
+		}
+		pthread_mutex_unlock(&uring.lock);
+	}
+	return count;
+}
+
+int uring_recv(struct timeval *tv, net_recv_fn_t recv_fn, void *recv_data)
+{
+	struct timespec start;
+	int count;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	count = reap(recv_fn, recv_data);
+	while (!count) {
+		struct timeval left;
+		int res;
+
+		if (tv) {
+			left = *tv;
+			net_tv_sub(&left, &start);
+			if (!left.tv_sec && !left.tv_usec)
+				break;
+		}
+		res = submit_and_wait(tv ? &left : NULL);
+		if (res < 0 && res != -ETIME && res != -EINTR) {
+			errno = -res;
+			perror("io_uring wait failed");
+			return -1;
+		}
+		count = reap(recv_fn, recv_data);
+	}
+
+	/* Send everything queued while handling this batch at once */
+	pthread_mutex_lock(&uring.lock);
+	submit_locked();
+	pthread_mutex_unlock(&uring.lock);
+
+	if (tv)
+		net_tv_sub(tv, &start);
+	return count;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2013-2015 Erik Ekman <yarrick@kryo.se>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright notice
+ * and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PINGFS_URING_H_
+#define PINGFS_URING_H_
+
+#include "net.h"
+#include "icmp.h"
+
+/* io_uring based network engine. Replies are received with one multishot
+ * recvmsg per socket into a registered ring of provided buffers, and sends
+ * made while handling replies are submitted together after each batch.
+ * Needs Linux 6.0 or later. */
+
+/* Set up ring for the sockets (-1 if not used). Returns 0 on success */
+int uring_open(int fdv4, enum icmp_transport transport_v4,
+	int fdv6, enum icmp_transport transport_v6);
+/* Close ring opened by uring_open() */
+void uring_close();
+
+/* Queue pkt for sending on socket fd. Returns number of bytes queued,
+ * or -1 on error. The payload is copied, so it can be reused directly. */
+int uring_send(int fd, struct icmp_packet *pkt);
+
+/* Same semantics as net_recv() */
+int uring_recv(struct timeval *tv, net_recv_fn_t recv_fn, void *recv_data);
+
+#endif /* PINGFS_URING_H_ */